@@ -0,0 +1,254 @@
+#pragma once
+#include <Arduino.h>
+#include "hal.h"
+#include "sensors.h"
+
+// Background ADC sampler for the selector switch and mode sensor inputs.
+// The ADC runs in free running (auto-trigger) mode with the conversion complete interrupt. The ISR round-robins
+// the channels, taking a burst of ADC_BURST conversions from each and throwing away the first one after the mux
+// changes (same reason the old code did a throw away analogRead before averaging).
+// Each channel has a ring buffer which is only written by the ISR, along with a sum of 4^n samples, so an averaged
+// reading is just a couple of loads for the caller.
+// n (oversampleBits, set per channel) is the oversample and decimate trade off: averaging 4^n samples gives n more
+// bits of resolution (the sensor noise is more than 1 count, which dithers the input) for a group delay of
+// adcGroupDelayUs(n). Up to ADC_WINDOW_BITS the sum is a moving window over the buffer, so the reading changes with
+// every sample. Above that (4^n samples don't fit in the buffer) it's a block decimator: the ISR adds up a block of
+// 4^n samples and the sum is replaced once per block, which costs no RAM but holds each reading for a block period.
+// Readings keep their READING_SHIFT fraction bits whatever n is (the ones below 10 + n bits are zero).
+// ADC clock = 16MHz/128 = 125kHz -> ~9.6k conversions/s -> ~3.6k kept samples/s per channel with 2 channels.
+// When parked (see idle.h) free running is stopped and sampleAsleep() takes single conversions instead.
+
+const byte ADC_CHANNELS = 2;
+const byte ADC_BUFFER_BITS = 4;
+const byte ADC_BUFFER_SIZE = 1 << ADC_BUFFER_BITS;  // Samples per channel (ADC_BUFFER_BITS <= READING_SHIFT so the average fits a reading)
+const byte ADC_BURST = 4;  // Conversions per channel before switching mux (first is discarded)
+const byte ADC_WINDOW_BITS = ADC_BUFFER_BITS / 2;  // Moving window up to here (4^n samples have to fit in the buffer)
+const byte ADC_MAX_OVERSAMPLE_BITS = 4;  // Block decimation above ADC_WINDOW_BITS (4^n * 1023 << READING_SHIFT fits 32 bits)
+constexpr uint32_t ADC_CONVERSION_US = 13UL * 128 * 1000000 / F_CPU;
+constexpr uint32_t ADC_SAMPLE_US = ADC_CONVERSION_US * ADC_BURST * ADC_CHANNELS / (ADC_BURST - 1);  // Mean time between kept samples on a channel
+
+constexpr uint32_t adcGroupDelayUs(uint8_t oversampleBits) {
+    // How far behind the input a reading averaging 4^oversampleBits samples is, on average. A block is also held
+    // for a block period (half of one on average) before the next replaces it
+    return ((oversampleBits <= ADC_WINDOW_BITS ? 1UL : 2UL) << (2*oversampleBits)) * ADC_SAMPLE_US / 2 - ADC_SAMPLE_US / 2;
+}
+
+constexpr uint8_t adcOversampleBitsFor(uint8_t oversampleBits) {
+    // Most that can be had of what's asked for: at most ADC_MAX_OVERSAMPLE_BITS and within ADC_MAX_GROUP_DELAY_US
+    return (oversampleBits == 0) ? 0
+        : (oversampleBits <= ADC_MAX_OVERSAMPLE_BITS && adcGroupDelayUs(oversampleBits) <= ADC_MAX_GROUP_DELAY_US)
+        ? oversampleBits : adcOversampleBitsFor(oversampleBits - 1);
+}
+
+static_assert(adcOversampleBitsFor(SWITCH_OVERSAMPLE_BITS) == SWITCH_OVERSAMPLE_BITS && adcOversampleBitsFor(MODE_OVERSAMPLE_BITS) == MODE_OVERSAMPLE_BITS, "Oversampling over ADC_MAX_OVERSAMPLE_BITS or ADC_MAX_GROUP_DELAY_US");
+
+struct AdcChannel {
+    uint8_t pin;
+    volatile uint16_t samples[ADC_BUFFER_SIZE];
+    volatile uint8_t head;  // Total samples written (wraps at 256), only written by ISR
+    volatile uint32_t sum;  // Sum of the newest windowSize samples, or of the last whole block
+    uint32_t block;  // Block decimation only: sum of the block being collected (ISR only)
+    uint16_t blockLeft;  // Samples still to go in it
+    uint8_t oversampleBits;
+    uint16_t windowSize;  // 4^oversampleBits
+};
+
+class AdcSampler {
+    private:
+        AdcChannel channels[ADC_CHANNELS];
+        byte numChannels = 0;
+        volatile uint8_t muxChannel = 0;  // Channel ADMUX is currently set to
+        volatile uint8_t converting = 0;  // Channel of the conversion in progress (started with the previous ADMUX)
+        volatile uint8_t lastDone = 0xFF;  // Channel of the last finished conversion
+        volatile uint8_t burstCount = 0;
+        volatile bool singleDone = false;
+        bool running = false;
+
+        void setMux(uint8_t index) {
+            halAdcSetChannel(channels[index].pin);
+        }
+
+        byte indexOf(uint8_t pin) {
+            for (byte i = 0; i < numChannels; i++) {
+                if (channels[i].pin == pin) {
+                    return i;
+                }
+            }
+            return 0;
+        }
+
+    public:
+        void begin(uint8_t pin0, uint8_t pin1, uint8_t oversampleBits0 = ADC_MAX_OVERSAMPLE_BITS, uint8_t oversampleBits1 = ADC_MAX_OVERSAMPLE_BITS) {
+            channels[0].pin = pin0;
+            channels[1].pin = pin1;
+            numChannels = ADC_CHANNELS;
+            setOversampling(pin0, oversampleBits0);
+            setOversampling(pin1, oversampleBits1);
+            start();
+            waitFresh();  // So the first averages are real
+        }
+
+        uint8_t setOversampling(uint8_t pin, uint8_t oversampleBits) {
+            // Readings of pin average 4^oversampleBits samples (n more bits, adcGroupDelayUs(n) behind). Capped by
+            // adcOversampleBitsFor(): returns the n actually used, which is less than asked for if it was capped
+            uint8_t n = adcOversampleBitsFor(oversampleBits);
+            AdcChannel &ch = channels[indexOf(pin)];
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                ch.oversampleBits = n;
+                ch.windowSize = 1U << (2*n);
+                uint8_t count = min(ch.windowSize, (uint16_t)ADC_BUFFER_SIZE);
+                uint32_t sum = 0;
+                for (uint8_t i = 1; i <= count; i++) {
+                    sum += ch.samples[(uint8_t)(ch.head - i) & (ADC_BUFFER_SIZE-1)];
+                }
+                ch.sum = sum * (ch.windowSize / count);  // A block starts off as the buffer's average
+                ch.block = 0;
+                ch.blockLeft = ch.windowSize;
+            }
+            return n;
+        }
+
+        uint8_t getOversampling(uint8_t pin) {
+            return channels[indexOf(pin)].oversampleBits;
+        }
+
+        uint32_t getGroupDelayUs(uint8_t pin) {
+            return adcGroupDelayUs(getOversampling(pin));
+        }
+
+        void waitFresh() {
+            // Wait until every buffer has been refilled with samples taken from now on (~5ms)
+            uint8_t heads[ADC_CHANNELS];
+            for (byte i = 0; i < numChannels; i++) {
+                heads[i] = channels[i].head;
+            }
+            for (byte i = 0; i < numChannels; i++) {
+                while ((uint8_t)(channels[i].head - heads[i]) < ADC_BUFFER_SIZE) {
+                    halWaitForInterrupt();
+                }
+            }
+        }
+
+        void start() {
+            // (Re)start free running conversions. Buffers are kept, so averages stay valid across a short stop()
+            if (running || numChannels == 0) {
+                return;
+            }
+            for (byte i = 0; i < numChannels; i++) {
+                pinMode(channels[i].pin, INPUT);
+            }
+            for (byte i = 0; i < numChannels; i++) {  // Blocks start again (sum keeps the last whole one)
+                channels[i].block = 0;
+                channels[i].blockLeft = channels[i].windowSize;
+            }
+            muxChannel = 0;
+            converting = 0;
+            lastDone = 0xFF;
+            burstCount = 0;
+            setMux(0);
+            halAdcStartFreeRunning();
+            running = true;
+        }
+
+        void stop() {
+            // Needed before using analogRead() directly (e.g. checking for a disconnected sensor)
+            if (!running) {
+                return;
+            }
+            halAdcStopFreeRunning();
+            running = false;
+        }
+
+        uint16_t sampleAsleep(uint8_t pin) {
+            // One conversion of pin with the CPU asleep, then the ADC is turned off. Only while stopped.
+            // The result isn't added to the buffers (they are refilled by waitFresh() after the next start())
+            halAdcSetChannel(pin);
+            singleDone = false;
+            halAdcSingleAsleep();
+            while (!singleDone) {  // Something else woke the CPU first
+                halWaitForInterrupt();
+            }
+            uint16_t value = halAdcResult();
+            halAdcOff();
+            return value;
+        }
+
+        uint32_t getSum(uint8_t pin) {
+            // Sum of 4^n samples. Lock free: retry if the ISR wrote a sample while reading
+            AdcChannel &ch = channels[indexOf(pin)];
+            uint8_t head;
+            uint32_t sum;
+            do {
+                head = ch.head;
+                sum = ch.sum;
+            } while (head != ch.head);
+            return sum;
+        }
+
+        reading_t getReading(uint8_t pin) {
+            // Average of 4^n samples as a fixed point reading (count << READING_SHIFT), 10 + n bits
+            return (getSum(pin) << READING_SHIFT) >> (2*channels[indexOf(pin)].oversampleBits);
+        }
+
+        uint16_t getLatest(uint8_t pin) {
+            // Most recent raw sample (10 bit count)
+            AdcChannel &ch = channels[indexOf(pin)];
+            return ch.samples[(uint8_t)(ch.head - 1) & (ADC_BUFFER_SIZE-1)];
+        }
+
+        bool pop(uint8_t pin, uint8_t &tail, uint16_t &value) {
+            // Single consumer FIFO access to the raw samples. The caller owns tail.
+            // If the caller falls more than a buffer behind, the oldest samples are skipped.
+            AdcChannel &ch = channels[indexOf(pin)];
+            uint8_t head = ch.head;
+            if (tail == head) {
+                return false;
+            }
+            if ((uint8_t)(head - tail) > ADC_BUFFER_SIZE) {
+                tail = head - ADC_BUFFER_SIZE;
+            }
+            value = ch.samples[tail & (ADC_BUFFER_SIZE-1)];
+            tail++;
+            return true;
+        }
+
+        void handleConversion() {
+            // Called from ADC_vect only
+            if (!running) {  // sampleAsleep() reads the result itself
+                singleDone = true;
+                return;
+            }
+            uint16_t value = halAdcResult();
+            uint8_t done = converting;
+            converting = muxChannel;  // Next conversion has already started using the current mux setting
+            if (++burstCount >= ADC_BURST) {
+                burstCount = 0;
+                muxChannel = (muxChannel + 1 < numChannels) ? muxChannel + 1 : 0;
+                setMux(muxChannel);  // Takes effect from the conversion after the one already running
+            }
+            if (done != lastDone) {  // First conversion on this channel since the mux changed
+                lastDone = done;
+                return;
+            }
+            AdcChannel &ch = channels[done];
+            uint8_t index = ch.head & (ADC_BUFFER_SIZE-1);
+            if (ch.oversampleBits <= ADC_WINDOW_BITS) {
+                ch.sum = ch.sum - ch.samples[(uint8_t)(ch.head - ch.windowSize) & (ADC_BUFFER_SIZE-1)] + value;  // Oldest in the window drops out
+            } else {
+                ch.block += value;
+                if (--ch.blockLeft == 0) {
+                    ch.sum = ch.block;
+                    ch.block = 0;
+                    ch.blockLeft = ch.windowSize;
+                }
+            }
+            ch.samples[index] = value;
+            ch.head = ch.head + 1;
+        }
+};
+
+AdcSampler adcSampler;
+
+HAL_ADC_INTERRUPT {
+    adcSampler.handleConversion();
+}
@@ -0,0 +1,145 @@
+// Cycle count benchmarks for the hot firmware functions (env:bench)
+// Built from the same headers as the firmware for the uno, and meant to be run in simavr (tools/bench.sh), although
+// it also works on a real board with a serial monitor. Timer1 runs at F_CPU with no prescaler so it counts CPU cycles
+// (overflows are counted to allow > 65535). It's the motor PWM timer in the firmware, so env:bench builds with BENCH,
+// which leaves the overflow interrupt to this file (MotorPwm::periodFromISR is called directly), and the counter is
+// set up after motor.begin(). Every other interrupt is turned off while measuring, so the numbers are
+// just the function itself. Results are printed as CSV: name,iterations,cycles per call,us per call
+#include <Arduino.h>
+#include <SPI.h>
+#include <Adafruit_ST7789.h>
+#include <avr/sleep.h>
+#include "specifications.h"
+#include "motor.h"
+#include "switch.h"
+#include "output.h"
+#include "adc.h"
+
+const uint8_t TFT_CS = 10, TFT_DC = 6, TFT_RST = 8;
+const uint8_t switchModePin = A0;
+const uint8_t motorModePin = A1;
+
+Adafruit_ST7789 tft = Adafruit_ST7789(TFT_CS, TFT_DC, TFT_RST);
+OtherOutputs output = OtherOutputs(&tft);
+SelectorSwitch selector = SelectorSwitch(switchModePin, &output);
+Motor motor = Motor(motorModePin, &output);
+ScreenOut screen = ScreenOut(&tft);
+
+volatile uint16_t timer1Overflows = 0;
+volatile int32_t sink;  // Results go here so the calls can't be optimised away
+uint32_t overheadCycles = 0;
+
+ISR(TIMER1_OVF_vect) {
+  timer1Overflows++;
+}
+
+uint32_t cycles() {
+  uint16_t low;
+  uint16_t high;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    low = TCNT1;
+    high = timer1Overflows;
+    if ((TIFR1 & _BV(TOV1)) && low < 0x8000) {  // Overflowed but the interrupt hasn't run yet
+      high++;
+    }
+  }
+  return ((uint32_t)high << 16) | low;
+}
+
+template <typename F>
+uint32_t measure(F function, uint16_t iterations) {
+  uint32_t start = cycles();
+  for (uint16_t i = 0; i < iterations; i++) {
+    function(i);
+  }
+  return (cycles() - start) / iterations;
+}
+
+template <typename F>
+void bench(const __FlashStringHelper *name, F function, uint16_t iterations) {
+  uint8_t timsk0 = TIMSK0, timsk2 = TIMSK2, adcsra = ADCSRA;
+  TIMSK0 = 0;  // millis()
+  TIMSK2 = 0;  // Control interrupt
+  ADCSRA &= ~_BV(ADIE);  // Background sampling
+  uint32_t perCall = measure(function, iterations);
+  perCall = (perCall > overheadCycles) ? perCall - overheadCycles : 0;
+  TIMSK0 = timsk0;
+  TIMSK2 = timsk2;
+  ADCSRA = adcsra;
+
+  Serial.print(name);
+  Serial.print(',');
+  Serial.print(iterations);
+  Serial.print(',');
+  Serial.print(perCall);
+  Serial.print(',');
+  Serial.println(perCall / (F_CPU / 1000000.0), 2);
+  Serial.flush();
+}
+
+void setup() {
+  Serial.begin(115200);
+  Serial.println(F("BENCH START"));
+  Serial.println(F("name,iterations,cycles,us"));
+
+  adcSampler.begin(switchModePin, motorModePin, SWITCH_OVERSAMPLE_BITS, MODE_OVERSAMPLE_BITS);
+  motor.begin();
+  screen.begin();
+
+  TCCR1B = 0;
+  TCCR1A = 0;
+  TCCR1B = _BV(CS10);  // F_CPU, normal mode (after motor.begin(), which sets Timer1 up for the motor PWM)
+  TCNT1 = 0;
+  TIMSK1 = _BV(TOIE1);
+
+  overheadCycles = measure([](uint16_t i) { sink = i; }, 1000);
+  Serial.print(F("loop overhead,1000,"));
+  Serial.println(overheadCycles);
+
+  // Sensors
+  bench(F("adcSampler.getReading"), [](uint16_t i) { sink = adcSampler.getReading(motorModePin); }, 1000);
+  bench(F("Motor::getPosition"), [](uint16_t i) { sink = motor.getPosition(); }, 1000);
+  bench(F("SelectorSwitch::getSwitchPosition"), [](uint16_t i) { sink = selector.getSwitchPosition(); }, 1000);
+  bench(F("SelectorSwitch::checkState"), [](uint16_t i) { selector.checkState(); }, 1000);
+  bench(F("lookupMotorPosition"), [](uint16_t i) { sink = lookupMotorPosition(i << 6); }, 1000);
+  bench(F("classifyMotorReading"), [](uint16_t i) { sink = classifyMotorReading(i << 6); }, 1000);
+  bench(F("readingToVolts"), [](uint16_t i) { sink = readingToVolts(i << 6); }, 200);
+  bench(F("readingToOhms"), [](uint16_t i) { sink = readingToOhms(i << 6); }, 200);
+
+  // Control interrupt (was updateMotorSpeed)
+  bench(F("isqrt32"), [](uint16_t i) { sink = isqrt32((uint32_t)i << 14); }, 1000);
+  motorControl.start(voltsToReadingFloor(LOCK_V));
+  bench(F("MotorControl::tick (driving)"), [](uint16_t i) { motorControl.tick(); }, 200);
+  motorControl.stop();
+  bench(F("MotorControl::tick (idle)"), [](uint16_t i) { motorControl.tick(); }, 1000);
+  bench(F("MotorControl::setOutput"), [](uint16_t i) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { motorControl.setOutput(TOWARD_4HI, (i & 0x7fff) + 1); }
+  }, 1000);
+  bench(F("MotorPwm::periodFromISR (ramping)"), [](uint16_t i) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { motorPwm.periodFromISR(); }
+  }, 1000);
+  bench(F("digitalWrite + analogWrite (old setOutput)"), [](uint16_t i) {
+    digitalWrite(MOTOR_DIR_PIN, i & 1); analogWrite(MOTOR_PWM_PIN, 100);
+  }, 1000);
+  motorControl.stop();
+
+  // Display (values change every call so every field is redrawn)
+  bench(F("ScreenOut::writeNormalValues (all fields)"), [](uint16_t i) {
+    screen.writeNormalValues((i & 1) ? "Shift completed successfully" : "Initializing Shift", i & 3, (i & 1) ? 20000 : 40000, (i + 1) & 3, (i & 1) ? 20000 : 40000, true);
+  }, 10);
+  bench(F("ScreenOut::writeBlock (main message)"), [](uint16_t i) {
+    screen.writeNormalValues((i & 1) ? "Shift completed successfully" : "Initializing Shift", 0, 0, 0, 0, true, FIELD_MESSAGE);
+  }, 10);
+  bench(F("ScreenOut::writeBlock (motor reading)"), [](uint16_t i) {
+    screen.writeNormalValues("", 0, 0, 0, (i & 1) ? 20000 : 40000, true, FIELD_MOTOR_READING);
+  }, 10);
+
+  Serial.println(F("BENCH END"));
+  Serial.flush();
+  cli();
+  sleep_enable();
+  sleep_cpu();  // simavr exits when the CPU sleeps with interrupts off
+}
+
+void loop() {
+}
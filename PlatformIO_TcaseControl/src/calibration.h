@@ -0,0 +1,145 @@
+#pragma once
+#include <Arduino.h>
+#include <EEPROM.h>
+#include "specifications.h"
+#include "sensors.h"
+#include "journal.h"
+
+// Learned mode sensor positions
+// LOCK_V/AWD_V/N_V/LO_V are measured on one unit. Motor::calibrate() visits each position, lets the shaft settle
+// into the detent with the brake off, then records the mean reading (the plateau) and the peak to peak noise with
+// the brake on. The results are kept in EEPROM (with a CRC) and used for the shift targets, for classifying the
+// mode sensor, and to widen the arrival tolerance on a noisy sensor.
+// Until a calibration has been stored everything is exactly as before (specifications.h and POSITION_LUT).
+
+const uint8_t CALIBRATION_VERSION = 1;
+
+struct __attribute__((packed)) CalibrationData {
+    uint8_t version;
+    reading_t plateau[4];  // Indexed by position
+    uint8_t noise[4];  // Peak to peak, ADC counts
+};
+
+const uint8_t CALIBRATION_RECORD_SIZE = sizeof(CalibrationData) + 1;  // + CRC
+
+constexpr reading_t SPEC_PLATEAU_R[4] = {
+    voltsToReadingFloor(LOCK_V), voltsToReadingFloor(AWD_V), voltsToReadingFloor(N_V), voltsToReadingFloor(LO_V)
+};
+constexpr reading_t DRIFT_TOLERANCE_R = voltsToReadingFloor(MOTOR_DRIFT_TOLERANCE_V);
+constexpr reading_t CALIBRATION_MAX_DRIFT_R = voltsToReadingFloor(CALIBRATION_MAX_DRIFT_V);
+constexpr reading_t SPEC_TOLERANCE_R = voltsToReadingFloor(POSITION_TOLERANCE);
+
+class SensorCalibration {
+    private:
+        CalibrationData data;
+        bool calibrated = false;
+
+        bool inDriftWindow(reading_t reading, uint8_t position) {
+            reading_t plateau = data.plateau[position];
+            reading_t distance = (reading > plateau) ? reading - plateau : plateau - reading;
+            return distance < DRIFT_TOLERANCE_R;
+        }
+
+    public:
+        void begin() {
+            uint8_t *bytes = (uint8_t *)&data;
+            eepromWriter.read(EEPROM_CALIBRATION_START, bytes, sizeof(data));
+            calibrated = data.version == CALIBRATION_VERSION
+                && crc8(bytes, sizeof(data)) == eepromWriter.read(EEPROM_CALIBRATION_START + sizeof(data))
+                && check(data);
+            if (!calibrated) {
+                clear();
+            }
+        }
+
+        bool check(const CalibrationData &candidate) {
+            // Plateaus have to be in the right order and no more than CALIBRATION_MAX_DRIFT_V from the spec values
+            for (uint8_t p = 0; p < 4; p++) {
+                reading_t spec = SPEC_PLATEAU_R[p];
+                reading_t plateau = candidate.plateau[p];
+                if ((plateau > spec ? plateau - spec : spec - plateau) > CALIBRATION_MAX_DRIFT_R) {
+                    return false;
+                }
+                if (p > 0 && plateau >= candidate.plateau[p - 1]) {  // LOCK is the highest voltage, LO the lowest
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        bool set(const CalibrationData &learned) {
+            // Use and store learned (if it passes check()). Written in the background by eepromWriter
+            if (!check(learned)) {
+                return false;
+            }
+            data = learned;
+            data.version = CALIBRATION_VERSION;
+            calibrated = true;
+            uint8_t record[CALIBRATION_RECORD_SIZE];
+            memcpy(record, &data, sizeof(data));
+            record[sizeof(data)] = crc8(record, sizeof(data));
+            while (!eepromWriter.write(EEPROM_CALIBRATION_START, record, sizeof(record))) {
+                halWaitForInterrupt();  // Only when calibrating, so waiting for room is fine
+            }
+            return true;
+        }
+
+        void clear() {
+            // Back to the spec values (doesn't touch EEPROM)
+            calibrated = false;
+            data.version = 0;
+            for (uint8_t p = 0; p < 4; p++) {
+                data.plateau[p] = SPEC_PLATEAU_R[p];
+                data.noise[p] = 0;
+            }
+        }
+
+        bool isCalibrated() {
+            return calibrated;
+        }
+
+        reading_t target(uint8_t position) {
+            return data.plateau[position];
+        }
+
+        uint8_t noise(uint8_t position) {
+            // Peak to peak ADC counts (0 when not calibrated)
+            return data.noise[position];
+        }
+
+        reading_t tolerance(uint8_t position) {
+            // Stop within this of target(). A sensor noisier than POSITION_TOLERANCE gets a wider window, otherwise
+            // the motor would keep chasing the noise
+            reading_t noise = (reading_t)data.noise[position] << READING_SHIFT;
+            return max(noise, SPEC_TOLERANCE_R);
+        }
+
+        int8_t classify(reading_t reading) {
+            // Same as lookupMotorPosition, but with windows around the learned plateaus when calibrated
+            if (!calibrated) {
+                return lookupMotorPosition(reading);
+            }
+            if (reading < MOTOR_LOW_LIMIT_R || reading > MOTOR_HIGH_LIMIT_R) {
+                return -2;
+            }
+            for (uint8_t p = 0; p < 4; p++) {
+                if (inDriftWindow(reading, p)) {
+                    return p;
+                }
+            }
+            return -1;
+        }
+
+        void print() {
+            // CSV over Serial: position, volts, noise (mV peak to peak) and whether it's learned or the spec value
+            Serial.println(F("position,volts,noise_mv,learned"));
+            for (uint8_t p = 0; p < 4; p++) {
+                Serial.print(p); Serial.print(',');
+                Serial.print(readingToVolts(data.plateau[p]), 3); Serial.print(',');
+                Serial.print((int)(data.noise[p]*ADC_VIN*1000/1023)); Serial.print(',');
+                Serial.println(calibrated ? 1 : 0);
+            }
+        }
+};
+
+SensorCalibration calibration;
@@ -0,0 +1,121 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+// Consistent Overhead Byte Stuffing and the telemetry packet layout
+// Shared by the firmware (telemetry.h) and the host decoder (tools/telemetry_decode.cpp), so no Arduino here.
+// A frame on the wire is COBS(payload + checksum) followed by a 0 byte. COBS removes every 0 from the data, so a
+// receiver can always resync at the next 0 and a lost byte only costs one packet.
+// Multi byte fields are little endian (native on both AVR and x86).
+
+const uint8_t TELEMETRY_SAMPLE = 1;  // Periodic sample from the control interrupt
+const uint8_t TELEMETRY_EVENT = 2;
+const uint8_t TELEMETRY_HISTORY = 3;  // Stored shift record, sent by the 'h' dump (see history.h)
+const uint8_t TELEMETRY_COUNTERS = 4;  // Stored totals for one from -> to pair, also sent by the 'h' dump
+
+const uint8_t EVENT_SHIFT_START = 1;
+const uint8_t EVENT_SHIFT_END = 2;
+
+struct __attribute__((packed)) TelemetrySample {
+    uint8_t type;  // TELEMETRY_SAMPLE
+    uint32_t timeUs;
+    uint16_t modeCount;  // Latest raw 10 bit ADC count of the mode sensor
+    uint16_t switchCount;  // Latest raw 10 bit ADC count of the selector switch
+    uint8_t pwm;  // Duty applied (0 -> 255)
+    int8_t direction;  // TOWARD_4HI/TOWARD_4LO, 0 = stopped
+    uint8_t brake;  // 1 = brake on
+    uint8_t phase;  // ShiftPhase (shiftlog.h), NUM_PHASES when not shifting
+};
+
+struct __attribute__((packed)) TelemetryEvent {
+    uint8_t type;  // TELEMETRY_EVENT
+    uint32_t timeUs;
+    uint8_t event;
+    int8_t from;
+    int8_t to;
+    uint8_t flags;  // SHIFT_SUCCESS etc. for EVENT_SHIFT_END
+};
+
+// These two are also how history.h stores them in EEPROM (each followed by a CRC-8)
+struct __attribute__((packed)) HistoryRecord {
+    uint16_t sequence;  // Counts up for every shift ever recorded
+    int8_t from;  // Last valid position when the shift started
+    int8_t to;
+    uint16_t durationMs;  // Whole attemptShift, including brake waits, retries and any recovery shift (capped at 65535)
+    uint8_t retries;
+    uint8_t stalls;  // How many of the retries were started by stall detection (the rest timed out)
+    uint8_t flags;  // SHIFT_SUCCESS etc. (shiftlog.h)
+    uint16_t finalReading;  // Mode sensor reading (reading_t, see sensors.h) once the brake was back on
+};
+
+struct __attribute__((packed)) PairCounters {
+    uint16_t shifts;
+    uint16_t failed;
+    uint16_t retries;
+    uint8_t recovered;  // Shifts where tryRecoverBadShift ran
+};
+
+struct __attribute__((packed)) TelemetryHistory {
+    uint8_t type;  // TELEMETRY_HISTORY
+    HistoryRecord record;
+};
+
+struct __attribute__((packed)) TelemetryCounters {
+    uint8_t type;  // TELEMETRY_COUNTERS
+    int8_t from;
+    int8_t to;
+    PairCounters counters;
+};
+
+const uint8_t TELEMETRY_MAX_PAYLOAD = 16;
+const uint8_t COBS_MAX_FRAME = TELEMETRY_MAX_PAYLOAD + 1 + 2;  // + checksum, + COBS overhead (1 per 254), + delimiter
+
+uint8_t telemetryChecksum(const uint8_t *data, size_t length) {
+    uint8_t sum = 0;
+    for (size_t i = 0; i < length; i++) {
+        sum += data[i];
+    }
+    return ~sum;
+}
+
+size_t cobsEncode(const uint8_t *in, size_t length, uint8_t *out) {
+    // out needs length + length/254 + 1 bytes. The 0 delimiter is not added
+    size_t codeIndex = 0;
+    size_t outIndex = 1;
+    uint8_t code = 1;
+    for (size_t i = 0; i < length; i++) {
+        if (in[i] == 0) {
+            out[codeIndex] = code;
+            codeIndex = outIndex++;
+            code = 1;
+        } else {
+            out[outIndex++] = in[i];
+            if (++code == 0xFF) {
+                out[codeIndex] = code;
+                codeIndex = outIndex++;
+                code = 1;
+            }
+        }
+    }
+    out[codeIndex] = code;
+    return outIndex;
+}
+
+size_t cobsDecode(const uint8_t *in, size_t length, uint8_t *out) {
+    // Returns the decoded length, or 0 if the frame is malformed
+    size_t inIndex = 0;
+    size_t outIndex = 0;
+    while (inIndex < length) {
+        uint8_t code = in[inIndex++];
+        if (code == 0 || inIndex + code - 1 > length) {
+            return 0;
+        }
+        for (uint8_t i = 1; i < code; i++) {
+            out[outIndex++] = in[inIndex++];
+        }
+        if (code < 0xFF && inIndex < length) {
+            out[outIndex++] = 0;
+        }
+    }
+    return outIndex;
+}
@@ -0,0 +1,277 @@
+#pragma once
+#include <Arduino.h>
+#include "hal.h"
+#include "specifications.h"
+#include "sensors.h"
+#include "adc.h"
+#include "profile.h"
+#include "estimator.h"
+#include "feedforward.h"
+#include "shiftlog.h"
+#include "telemetry.h"
+#include "motorpwm.h"
+
+// Fixed rate motor control
+// Timer2 (CTC mode) interrupts at CONTROL_RATE_HZ and each tick sets motor speed/direction from the latest mode
+// sensor reading (averaged in the background by adcSampler). Motor::attemptShift only sets the target and watches
+// for it being reached, so the control rate no longer depends on how long everything else in the loop takes.
+// How speed changes over a shift is up to the MotionProfile (see profile.h). The profile is given the distance left
+// minus how far the estimated velocity will carry the motor in ESTIMATOR_LOOKAHEAD_MS, so it starts slowing early.
+// If the estimated velocity toward the target stays below what the applied PWM should give for STALL_TIME_MS the
+// shift is stopped and hasStalled() is set, rather than waiting for MAX_SHIFT_TIME_S.
+// Speed is turned into a duty by the learned motor model (see feedforward.h), which is fed from every shift tick.
+
+constexpr reading_t POSITION_TOLERANCE_R = voltsToReadingFloor(POSITION_TOLERANCE);
+constexpr reading_t MAX_DISTANCE_R = voltsToReadingFloor(1.0);  // Distances are capped at 1V (speed is maxed out by then anyway)
+const uint16_t DIRECTION_CHANGE_TICKS = CONTROL_RATE_HZ / 10;  // Stay stopped for 100ms before reversing
+const uint16_t LOOKAHEAD_TICKS = (uint32_t)ESTIMATOR_LOOKAHEAD_MS * CONTROL_RATE_HZ / 1000;
+const uint16_t STALL_TICKS = (uint32_t)STALL_TIME_MS * CONTROL_RATE_HZ / 1000;
+const uint16_t STALL_GRACE_TICKS = (uint32_t)STALL_GRACE_MS * CONTROL_RATE_HZ / 1000;
+// Minimum velocity (readings/tick << ESTIMATOR_FRACTION_BITS) per PWM count applied, << STALL_VELOCITY_FRACTION_BITS
+// (without the extra bits it truncates to ~7, up to 15% off STALL_MIN_VELOCITY_V_S)
+const uint8_t STALL_VELOCITY_FRACTION_BITS = 4;
+constexpr uint32_t STALL_VELOCITY_EXACT = ((uint32_t)voltsToReadingFloor(STALL_MIN_VELOCITY_V_S) << (ESTIMATOR_FRACTION_BITS + STALL_VELOCITY_FRACTION_BITS)) / CONTROL_RATE_HZ;
+constexpr uint16_t STALL_VELOCITY_PER_PWM = STALL_VELOCITY_EXACT / 255;
+static_assert((STALL_VELOCITY_EXACT - STALL_VELOCITY_PER_PWM*255UL)*50 < STALL_VELOCITY_EXACT, "STALL_VELOCITY_PER_PWM rounding over 2%, add fraction bits");
+
+// Timer2 with /128 prescaler
+constexpr uint16_t CONTROL_TIMER_TOP = F_CPU / 128 / CONTROL_RATE_HZ - 1;
+static_assert(CONTROL_TIMER_TOP <= 255, "CONTROL_RATE_HZ too low for Timer2 with /128 prescaler");
+
+class MotorControl {
+    private:
+        uint8_t modePin;
+        volatile bool active = false;  // Interrupt is driving the motor
+        volatile bool arrived = false;  // Set by the interrupt once within POSITION_TOLERANCE of target
+        volatile bool stalled = false;  // Set by the interrupt if a shift stopped because the motor wasn't moving
+        volatile bool manual = false;  // Drive in manualDirection without a target
+        volatile int8_t manualDirection = 0;
+        volatile reading_t target = 0;
+        volatile reading_t tolerance = POSITION_TOLERANCE_R;  // Arrived once this close to target
+        uint16_t speed = 0;  // Only touched by the interrupt while active
+        int8_t direction = 0;
+        uint16_t holdTicks = 0;
+        uint16_t drivenTicks = 0;  // Ticks driven since starting/reversing
+        uint16_t slowTicks = 0;  // Consecutive ticks (after the grace period) that were too slow
+        uint8_t appliedPwm = 0;
+        MotionProfile profile;
+        PositionEstimator estimator;
+
+        reading_t lead(int8_t wanted) {
+            // How far the motor will travel toward the target in LOOKAHEAD_TICKS at the estimated velocity
+            int32_t velocity = estimator.rawVelocity();  // +ve is increasing reading (TOWARD_4HI)
+            if (wanted == TOWARD_4LO) {
+                velocity = -velocity;
+            }
+            if (velocity <= 0) {
+                return 0;
+            }
+            int32_t travel = (velocity * LOOKAHEAD_TICKS) >> ESTIMATOR_FRACTION_BITS;
+            return min(travel, (int32_t)MAX_DISTANCE_R);
+        }
+
+        void logPhase(uint16_t newSpeed) {
+            // Which part of the motion profile this tick was in (see shiftlog.h)
+            if (appliedPwm <= feedForward.minDuty(direction) && newSpeed <= speed) {
+                shiftLog.enterFromISR(PHASE_SETTLE);
+            } else if (newSpeed > speed) {
+                shiftLog.enterFromISR(PHASE_ACCEL);
+            } else if (newSpeed < speed) {
+                shiftLog.enterFromISR(PHASE_DECEL);
+            } else if (newSpeed >= SPEED_ONE) {
+                shiftLog.enterFromISR(PHASE_CRUISE);
+            }
+        }
+
+        bool checkStall() {
+            // Returns true once the motor has been slower than the applied PWM should give for STALL_TICKS
+            if (drivenTicks < STALL_GRACE_TICKS) {
+                drivenTicks++;
+                return false;
+            }
+            int32_t progress = estimator.rawVelocity();
+            if (direction == TOWARD_4LO) {
+                progress = -progress;
+            }
+            feedForward.sampleFromISR(direction, appliedPwm, progress);
+            if ((progress << STALL_VELOCITY_FRACTION_BITS) >= (int32_t)STALL_VELOCITY_PER_PWM * appliedPwm) {
+                slowTicks = 0;
+                return false;
+            }
+            return ++slowTicks >= STALL_TICKS;
+        }
+
+    public:
+        void begin(uint8_t mode) {
+            modePin = mode;
+            motorPwm.begin();
+            estimator.begin(mode);
+            halControlTimerBegin(CONTROL_TIMER_TOP);
+        }
+
+        void pause() {
+            // Parked (idle.h): stop the control and PWM interrupts so only the millis tick wakes the CPU. Not while active
+            halControlTimerEnable(false);
+            motorPwm.pause();
+        }
+
+        void resume() {
+            // After pause(), once adcSampler is running again. The estimator starts over from the next measurement
+            // rather than predicting on from where it was
+            estimator.restart();
+            motorPwm.resume();
+            halControlTimerEnable(true);
+        }
+
+        void setOutput(int8_t dir, uint16_t newSpeed) {
+            // Set the motor duty (motorPwm ramps to it over the next PWM periods). newSpeed == 0 or dir == 0 stops the motor
+            // Interrupts must be off (control interrupt, or an ATOMIC_BLOCK)
+            // appliedPwm is the duty in whole PWM counts, for the stall check, the motor model and telemetry
+            if (newSpeed > 0 && (dir == TOWARD_4LO || dir == TOWARD_4HI)) {
+                uint16_t duty = feedForward.duty(dir, newSpeed);
+                appliedPwm = duty >> MOTOR_DUTY_FRACTION_BITS;
+                motorPwm.set(dir, duty);
+            } else {
+                appliedPwm = 0;
+                motorPwm.set(0, 0);
+            }
+        }
+
+        void start(reading_t targetReading, reading_t targetTolerance = POSITION_TOLERANCE_R) {
+            // Drive toward targetReading from the next tick (brake must already be released)
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                target = targetReading;
+                tolerance = targetTolerance;
+                manual = false;
+                arrived = false;
+                stalled = false;
+                speed = 0;
+                direction = 0;
+                holdTicks = 0;
+                drivenTicks = 0;
+                slowTicks = 0;
+                active = true;
+            }
+        }
+
+        void drive(int8_t dir) {
+            // Manual drive in dir until stop() (ramps up the same way as a shift)
+            if (active && manual && manualDirection == dir) {
+                return;
+            }
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                manualDirection = dir;
+                if (!(active && manual)) {
+                    speed = 0;
+                    direction = 0;
+                    holdTicks = 0;
+                }
+                manual = true;
+                arrived = false;
+                active = true;
+            }
+        }
+
+        void stop() {
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                active = false;
+                speed = 0;
+                direction = 0;
+                setOutput(0, 0);
+            }
+        }
+
+        void setProfile(byte profileType) {
+            // PROFILE_STEPS or PROFILE_TRAPEZOID (default is MOTION_PROFILE)
+            profile.setType(profileType);
+        }
+
+        reading_t estimatedPosition() {
+            return estimator.position();
+        }
+
+        int32_t estimatedVelocity() {
+            // Readings per second
+            return estimator.velocity();
+        }
+
+        bool hasArrived() {
+            return arrived;
+        }
+
+        bool hasStalled() {
+            return stalled;
+        }
+
+        bool isActive() {
+            return active;
+        }
+
+        void tick() {
+            // Called from TIMER2_COMPA_vect only
+            estimator.update();  // Always runs so the estimate is settled before a shift starts
+            telemetry.sampleFromISR(direction, appliedPwm);
+            if (!active) {
+                return;
+            }
+            int8_t wanted;
+            reading_t distance;
+            if (manual) {
+                wanted = manualDirection;
+                distance = MAX_DISTANCE_R;
+            } else {
+                reading_t current = adcSampler.getReading(modePin);
+                distance = (current > target) ? current - target : target - current;
+                if (distance <= tolerance) {
+                    active = false;
+                    arrived = true;
+                    speed = 0;
+                    direction = 0;
+                    setOutput(0, 0);
+                    return;
+                }
+                wanted = (current <= target) ? TOWARD_4HI : TOWARD_4LO;
+                reading_t ahead = lead(wanted);
+                distance = (distance > ahead) ? distance - ahead : 0;
+                distance = min(distance, MAX_DISTANCE_R);
+            }
+
+            if (direction != 0 && wanted != direction) {  // Change of direction!! Stop and hold for a bit first
+                speed = 0;
+                direction = 0;
+                holdTicks = DIRECTION_CHANGE_TICKS;
+                drivenTicks = 0;
+                slowTicks = 0;
+                setOutput(0, 0);
+                if (!manual) {
+                    shiftLog.enterFromISR(PHASE_SETTLE);
+                }
+                return;
+            }
+            if (holdTicks > 0) {
+                holdTicks--;
+                return;
+            }
+            if (!manual && direction != 0 && checkStall()) {
+                active = false;
+                stalled = true;
+                speed = 0;
+                direction = 0;
+                setOutput(0, 0);
+                return;
+            }
+            direction = wanted;
+            uint16_t newSpeed = profile.nextSpeed(speed, distance, direction);
+            setOutput(direction, newSpeed);
+            if (!manual) {
+                logPhase(newSpeed);
+            }
+            speed = newSpeed;
+        }
+};
+
+MotorControl motorControl;
+
+HAL_CONTROL_INTERRUPT {
+    motorControl.tick();
+}
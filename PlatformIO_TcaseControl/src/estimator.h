@@ -0,0 +1,101 @@
+#pragma once
+#include <Arduino.h>
+#include "hal.h"
+#include "specifications.h"
+#include "sensors.h"
+#include "adc.h"
+
+// Alpha-beta position/velocity estimator for the mode sensor
+// update() is called once per control tick (from the Timer2 interrupt). It drains the new raw samples from the
+// adcSampler FIFO, averages them as the measurement, and corrects a constant velocity prediction:
+//   predicted = position + velocity
+//   position  = predicted + residual/2^ESTIMATOR_ALPHA_SHIFT
+//   velocity  = velocity  + residual/2^ESTIMATOR_BETA_SHIFT
+// Position is a reading (see sensors.h) and velocity is readings per tick, both kept with 8 extra fraction bits.
+
+const uint8_t ESTIMATOR_FRACTION_BITS = 8;
+
+class PositionEstimator {
+    private:
+        uint8_t pin;
+        uint8_t tail = 0;  // adcSampler FIFO position
+        bool started = false;
+        int32_t pos = 0;  // reading << ESTIMATOR_FRACTION_BITS
+        int32_t vel = 0;  // readings/tick << ESTIMATOR_FRACTION_BITS
+
+        bool measure(reading_t &measurement) {
+            uint16_t sum = 0;
+            uint8_t count = 0;
+            uint16_t value;
+            while (adcSampler.pop(pin, tail, value)) {  // At most ADC_BUFFER_SIZE samples, so sum can't overflow
+                sum += value;
+                count++;
+            }
+            if (count == 0) {
+                return false;
+            }
+            measurement = ((uint32_t)sum << READING_SHIFT) / count;
+            return true;
+        }
+
+    public:
+        void begin(uint8_t modePin) {
+            pin = modePin;
+            started = false;
+        }
+
+        void restart() {
+            // Start again from the next measurement (velocity 0), e.g. after the control interrupt has been stopped.
+            // Control interrupt off
+            started = false;
+            vel = 0;
+        }
+
+        void update() {
+            // Called from the control interrupt only
+            reading_t measurement;
+            if (!measure(measurement)) {
+                pos += vel;  // No new samples, prediction only
+                return;
+            }
+            int32_t measured = (int32_t)measurement << ESTIMATOR_FRACTION_BITS;
+            if (!started) {
+                pos = measured;
+                vel = 0;
+                started = true;
+                return;
+            }
+            int32_t predicted = pos + vel;
+            int32_t residual = measured - predicted;
+            pos = predicted + (residual >> ESTIMATOR_ALPHA_SHIFT);
+            vel = vel + (residual >> ESTIMATOR_BETA_SHIFT);
+        }
+
+        int32_t rawPosition() {
+            // Interrupt context only (no atomic copy)
+            return pos >> ESTIMATOR_FRACTION_BITS;
+        }
+
+        int32_t rawVelocity() {
+            // Interrupt context only: readings/tick << ESTIMATOR_FRACTION_BITS
+            return vel;
+        }
+
+        reading_t position() {
+            int32_t p;
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                p = pos;
+            }
+            p >>= ESTIMATOR_FRACTION_BITS;
+            return (p < 0) ? 0 : (p > (int32_t)READING_FULL_SCALE) ? READING_FULL_SCALE : p;
+        }
+
+        int32_t velocity() {
+            // Readings per second (+ve is increasing voltage)
+            int32_t v;
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                v = vel;
+            }
+            return (v * (int32_t)CONTROL_RATE_HZ) >> ESTIMATOR_FRACTION_BITS;
+        }
+};
@@ -0,0 +1,112 @@
+#pragma once
+#include <Arduino.h>
+#include "hal.h"
+
+// Compile time pins for the motor driver outputs
+// The pin number is a template parameter, so the port and bit are worked out by the compiler and a write is a single
+// SBI/CBI instruction, where digitalWrite looks both up in PROGMEM tables and saves/restores SREG on every call.
+// PwmPin writes the timer's OCR register directly (analogWrite does the same lookups plus a switch on the timer).
+// Arduino Uno/Nano numbering: 0-7 = PORTD, 8-13 = PORTB, 14-19 (A0-A5) = PORTC.
+// The native build (sim/) has no registers, so there they forward to the simulated Arduino API.
+
+template <uint8_t PIN>
+struct FastPin {
+    static_assert(PIN < 20, "FastPin only knows the ATmega328 pins");
+
+#ifdef __AVR__
+    static void output() {
+        if (PIN < 8) {
+            DDRD |= _BV(PIN);
+        } else if (PIN < 14) {
+            DDRB |= _BV(PIN - 8);
+        } else {
+            DDRC |= _BV(PIN - 14);
+        }
+    }
+
+    static void high() {
+        if (PIN < 8) {
+            PORTD |= _BV(PIN);
+        } else if (PIN < 14) {
+            PORTB |= _BV(PIN - 8);
+        } else {
+            PORTC |= _BV(PIN - 14);
+        }
+    }
+
+    static void low() {
+        if (PIN < 8) {
+            PORTD &= ~_BV(PIN);
+        } else if (PIN < 14) {
+            PORTB &= ~_BV(PIN - 8);
+        } else {
+            PORTC &= ~_BV(PIN - 14);
+        }
+    }
+#else
+    static void output() {
+        pinMode(PIN, OUTPUT);
+    }
+
+    static void high() {
+        digitalWrite(PIN, HIGH);
+    }
+
+    static void low() {
+        digitalWrite(PIN, LOW);
+    }
+#endif
+
+    static void write(bool value) {
+        if (value) {
+            high();
+        } else {
+            low();
+        }
+    }
+};
+
+// PWM outputs. Timer2's pins (3 and 11) aren't here because Timer2 runs the control interrupt (control.h).
+// Timer0 is left as the Arduino core sets it up (fast PWM, 8 bit). Timer1 is the motor's (motorpwm.h), with ICR1 as
+// TOP, so its duty is a 16 bit count out of that.
+// write(0) disconnects the pin from the timer and drives it low (fast PWM would still give a 1 count pulse at OCR = 0)
+#ifdef __AVR__
+#define FAST_PWM_PIN(PIN, TCCR, COM, OCR, TYPE) \
+    template <> \
+    struct PwmPin<PIN> { \
+        static void write(TYPE duty) { \
+            if (duty == 0) { \
+                ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { \
+                    TCCR &= ~_BV(COM); \
+                } \
+                FastPin<PIN>::low(); \
+            } else { \
+                OCR = duty; \
+                ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { \
+                    TCCR |= _BV(COM); \
+                } \
+            } \
+        } \
+    };
+
+template <uint8_t PIN>
+struct PwmPin;  // No timer on this pin (or it's Timer2)
+
+FAST_PWM_PIN(5, TCCR0A, COM0B1, OCR0B, uint8_t)
+FAST_PWM_PIN(6, TCCR0A, COM0A1, OCR0A, uint8_t)
+FAST_PWM_PIN(9, TCCR1A, COM1A1, OCR1A, uint16_t)
+FAST_PWM_PIN(10, TCCR1A, COM1B1, OCR1B, uint16_t)
+
+#undef FAST_PWM_PIN
+#else
+template <uint8_t PIN>
+struct PwmPin {
+    static void write(uint16_t duty) {
+        if (duty == 0) {
+            digitalWrite(PIN, LOW);
+        } else {
+            analogWrite(PIN, duty);
+        }
+    }
+};
+#endif
@@ -0,0 +1,233 @@
+#pragma once
+#include <Arduino.h>
+#include <EEPROM.h>
+#include "hal.h"
+#include "specifications.h"
+#include "sensors.h"
+#include "profile.h"
+#include "estimator.h"
+#include "journal.h"
+
+// Learned motor model: mode sensor velocity = gain*(PWM - deadband), one line for each direction
+// The control interrupt turns a profile speed into a duty with duty(). Speed 0 is deadband + FF_CREEP_MARGIN, so the
+// slowest speed always just overcomes friction (whatever this motor's friction is). Until both directions have been
+// learned, speed 0 -> 1 is spread linearly from there to PWM_MAX_POWER. After that the gain sets the top end:
+// SPEED_ONE is what the slower direction does at PWM_MAX_POWER, and the faster direction gets the duty that gives
+// the same velocity (velocity/gain above the deadband), so a profile moves the mode sensor at the same rate both ways.
+// While a shift is being driven, every tick where the duty has been constant for FF_STEADY_TICKS (so the motor has
+// caught up with it) adds (duty, estimated velocity) to a least squares fit. When the shift ends the fit is blended
+// into the model. Shifts that stalled are left out (a jam isn't the motor). saveIfChanged() (a scheduler task in
+// main.cpp) writes the model to EEPROM once it has moved, after the end of shift history writes have drained.
+// The first FF_BASELINE_UPDATES fits are the baseline. If the gain later drops below FF_WEAK_GAIN_FRACTION of it,
+// isWeak() is set for that direction (the shift gets SHIFT_MOTOR_WEAK in its history record and the display says so).
+// Until anything has been learned the deadband is PWM_MIN_POWER - FF_CREEP_MARGIN, i.e. PWM_MIN_POWER -> PWM_MAX_POWER.
+
+const uint8_t FF_VELOCITY_SHIFT = 4;  // Samples are estimator velocity (Q8 readings/tick) >> this, to keep the sums in 32 bits
+const uint16_t FF_MAX_SAMPLES = 4096;
+
+struct __attribute__((packed)) MotorModelData {
+    uint8_t updates[2];  // Fits blended in so far, per direction (saturates at 255)
+    uint8_t deadband[2];  // PWM counts
+    uint16_t gain[2];  // Velocity (readings/tick << (8 - FF_VELOCITY_SHIFT)) per PWM count, << 8
+    uint16_t baseline[2];  // gain once FF_BASELINE_UPDATES fits had been made
+};
+
+const uint8_t MOTOR_MODEL_RECORD_SIZE = sizeof(MotorModelData) + 1;  // + CRC
+
+struct FitSums {
+    uint16_t count;
+    uint32_t pwm;
+    int32_t velocity;
+    uint32_t pwmSquared;
+    int32_t pwmVelocity;
+};
+
+class FeedForward {
+    private:
+        MotorModelData model;
+        MotorModelData saved;  // What's in EEPROM
+        FitSums sums[2];  // Only touched by the interrupt while a shift is being driven
+        uint8_t lastPwm = 0;
+        uint8_t steadyTicks = 0;
+        bool weak[2] = {false, false};
+        uint16_t dutySpan[2];  // Added to minDuty() at SPEED_ONE, motorPwm units
+
+        uint8_t index(int8_t direction) {
+            return (direction == TOWARD_4LO) ? 1 : 0;
+        }
+
+        bool changed(uint8_t i) {
+            // Worth an EEPROM write
+            uint16_t gainStep = saved.gain[i] / 16;  // ~6%
+            return model.updates[i] != saved.updates[i] && (model.updates[i] <= FF_BASELINE_UPDATES
+                || abs((int)model.deadband[i] - saved.deadband[i]) >= 2
+                || abs((int32_t)model.gain[i] - saved.gain[i]) > gainStep);
+        }
+
+        void learn(uint8_t i, const FitSums &s) {
+            // Least squares line through the samples. If the duty barely varied (e.g. a short shift that never got
+            // past the creep speed) only the gain is updated, keeping the current deadband
+            if (s.count < FF_MIN_SAMPLES) {
+                return;
+            }
+            float n = s.count;
+            float meanPwm = s.pwm / n;
+            float meanVelocity = s.velocity / n;
+            float spread = s.pwmSquared / n - meanPwm*meanPwm;  // Variance of the duty
+            float gain;
+            float deadband = model.deadband[i];
+            if (spread >= FF_MIN_PWM_SPREAD*FF_MIN_PWM_SPREAD) {
+                gain = (s.pwmVelocity / n - meanPwm*meanVelocity) / spread;
+                deadband = meanPwm - meanVelocity / gain;
+            } else if (meanPwm - deadband >= FF_MIN_PWM_SPREAD) {
+                gain = meanVelocity / (meanPwm - deadband);
+            } else {
+                return;
+            }
+            if (!(gain > 0) || deadband < 0 || deadband > PWM_MAX_POWER / 2 || gain*256 > 65535) {
+                return;  // Not believable
+            }
+            if (model.updates[i] == 0) {  // First fit replaces the defaults
+                model.gain[i] = gain*256;
+                model.deadband[i] = deadband + 0.5f;
+            } else {
+                model.gain[i] += (int32_t)(gain*256 - model.gain[i]) >> FF_BLEND_SHIFT;
+                model.deadband[i] += (int)(deadband - model.deadband[i]) >> FF_BLEND_SHIFT;
+            }
+            if (model.updates[i] < 255) {
+                model.updates[i]++;
+            }
+            if (model.updates[i] == FF_BASELINE_UPDATES) {
+                model.baseline[i] = model.gain[i];
+            }
+            if (model.updates[i] > FF_BASELINE_UPDATES) {
+                weak[i] = model.gain[i] < model.baseline[i]*FF_WEAK_GAIN_FRACTION;
+            }
+        }
+
+    public:
+        void begin() {
+            uint8_t *bytes = (uint8_t *)&model;
+            eepromWriter.read(EEPROM_MOTOR_MODEL_START, bytes, sizeof(model));
+            if (crc8(bytes, sizeof(model)) != eepromWriter.read(EEPROM_MOTOR_MODEL_START + sizeof(model))) {
+                memset(&model, 0, sizeof(model));  // Nothing learned yet
+                model.deadband[0] = model.deadband[1] = PWM_MIN_POWER - FF_CREEP_MARGIN;
+            }
+            saved = model;
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                memset(sums, 0, sizeof(sums));
+            }
+            scaleDuty();
+        }
+
+        void scaleDuty() {
+            // Work out dutySpan from the model and PWM_MAX_POWER (main loop, whenever either changes), so duty() needs no
+            // division
+            uint16_t span[2];
+            uint16_t high = (uint16_t)PWM_MAX_POWER << MOTOR_DUTY_FRACTION_BITS;
+            uint32_t fullVelocity = UINT32_MAX;  // Of the slower direction, gain units (PWM counts above the deadband)
+            for (uint8_t i = 0; i < 2; i++) {
+                uint16_t low = (uint16_t)minDuty(i ? TOWARD_4LO : TOWARD_4HI) << MOTOR_DUTY_FRACTION_BITS;
+                span[i] = (low < high) ? high - low : 0;
+                uint32_t v = (uint32_t)model.gain[i] * (PWM_MAX_POWER - min(model.deadband[i], PWM_MAX_POWER));
+                fullVelocity = min(fullVelocity, v);
+            }
+            if (model.updates[0] > 0 && model.updates[1] > 0) {
+                for (uint8_t i = 0; i < 2; i++) {
+                    // Duty above the deadband for fullVelocity, which is <= PWM_MAX_POWER - deadband (gain > 0 once learned)
+                    uint32_t full = (fullVelocity << MOTOR_DUTY_FRACTION_BITS) / model.gain[i];
+                    uint16_t creep = (uint16_t)FF_CREEP_MARGIN << MOTOR_DUTY_FRACTION_BITS;
+                    span[i] = (full > creep) ? min((uint32_t)span[i], full - creep) : 0;
+                }
+            }
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                memcpy(dutySpan, span, sizeof(span));
+            }
+        }
+
+        uint16_t duty(int8_t direction, uint16_t speed) {
+            // Duty for speed (SPEED_ONE = full speed) in direction, never below minDuty() or above PWM_MAX_POWER. In
+            // motorPwm units (PWM counts << MOTOR_DUTY_FRACTION_BITS). Control interrupt only
+            uint16_t low = (uint16_t)minDuty(direction) << MOTOR_DUTY_FRACTION_BITS;
+            uint16_t high = (uint16_t)PWM_MAX_POWER << MOTOR_DUTY_FRACTION_BITS;
+            if (low >= high) {
+                return high;
+            }
+            return min(low + (((uint32_t)dutySpan[index(direction)] * min(speed, SPEED_ONE)) >> 15), (uint32_t)high);
+        }
+
+        uint8_t minDuty(int8_t direction) {
+            return min(model.deadband[index(direction)] + FF_CREEP_MARGIN, 255);
+        }
+
+        void sampleFromISR(int8_t direction, uint8_t pwm, int32_t velocity) {
+            // Control interrupt only. velocity is the estimator's (Q8 readings/tick, +ve toward the target direction)
+            if (pwm != lastPwm) {
+                lastPwm = pwm;
+                steadyTicks = 0;
+                return;
+            }
+            if (steadyTicks < FF_STEADY_TICKS) {
+                steadyTicks++;
+                return;
+            }
+            FitSums &s = sums[index(direction)];
+            if (pwm == 0 || s.count >= FF_MAX_SAMPLES) {
+                return;
+            }
+            int32_t v = velocity >> FF_VELOCITY_SHIFT;
+            s.count++;
+            s.pwm += pwm;
+            s.velocity += v;
+            s.pwmSquared += (uint16_t)pwm*pwm;
+            s.pwmVelocity += v*pwm;
+        }
+
+        void endShift(bool stalled) {
+            // Fit and blend in what was sampled during the shift (main loop, after the motor has stopped)
+            FitSums copy[2];
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                memcpy(copy, sums, sizeof(sums));
+                memset(sums, 0, sizeof(sums));
+                lastPwm = 0;
+                steadyTicks = 0;
+            }
+            if (stalled) {
+                return;
+            }
+            for (uint8_t i = 0; i < 2; i++) {
+                learn(i, copy[i]);
+            }
+            scaleDuty();
+        }
+
+        void saveIfChanged() {
+            // Queue the model for writing if it's worth it and there's room (otherwise try again next call)
+            if (!(changed(0) || changed(1))) {
+                return;
+            }
+            uint8_t record[MOTOR_MODEL_RECORD_SIZE];
+            memcpy(record, &model, sizeof(model));
+            record[sizeof(model)] = crc8(record, sizeof(model));
+            if (eepromWriter.write(EEPROM_MOTOR_MODEL_START, record, sizeof(record))) {
+                saved = model;
+            }
+        }
+
+        bool isWeak() {
+            // Either direction
+            return weak[0] || weak[1];
+        }
+
+        float velocityPerPwm(int8_t direction) {
+            // Learned gain in V/s per PWM count (0 if nothing learned yet)
+            uint8_t i = index(direction);
+            return model.gain[i] / 256.0f / (1 << (ESTIMATOR_FRACTION_BITS - FF_VELOCITY_SHIFT)) * CONTROL_RATE_HZ * ADC_VIN / READING_FULL_SCALE;
+        }
+
+        uint8_t deadband(int8_t direction) {
+            return model.deadband[index(direction)];
+        }
+};
+
+FeedForward feedForward;
@@ -0,0 +1,143 @@
+#pragma once
+#include <Arduino.h>
+#include <util/atomic.h>
+
+// Hardware abstraction for the peripherals the firmware programs directly (rather than through the Arduino API).
+// On the board these are register writes. The native build (env:native, see sim/) provides the same functions
+// plus its own Arduino API, backed by a simulated transfer case, so the firmware classes compile unchanged on Linux.
+// HAL_ADC_INTERRUPT / HAL_CONTROL_INTERRUPT / HAL_EEPROM_INTERRUPT / HAL_MOTOR_PWM_INTERRUPT define the interrupt handlers (plain functions the simulator calls in
+// the native build). Loops that spin waiting for an interrupt to change something must call halWaitForInterrupt(),
+// since simulated interrupts only happen when simulated time moves.
+
+#ifdef __AVR__
+
+#include <avr/sleep.h>
+
+void halAdcSetChannel(uint8_t pin) {
+    ADMUX = _BV(REFS0) | ((pin - A0) & 0x07);  // AVcc reference (same as analogRead DEFAULT)
+}
+
+void halAdcStartFreeRunning() {
+    // Auto-trigger (free running) with the conversion complete interrupt, /128 prescaler (125kHz ADC clock)
+    ADCSRB = 0;
+    ADCSRA = _BV(ADEN) | _BV(ADATE) | _BV(ADIE) | _BV(ADIF) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);
+    ADCSRA |= _BV(ADSC);
+}
+
+void halAdcStopFreeRunning() {
+    ADCSRA &= ~(_BV(ADATE) | _BV(ADIE));
+    while (ADCSRA & _BV(ADSC)) {  // Let the conversion in progress finish
+    }
+    ADCSRA |= _BV(ADIF);
+}
+
+uint16_t halAdcResult() {
+    return ADC;
+}
+
+void halAdcSingleAsleep() {
+    // One conversion with the conversion complete interrupt, in ADC noise reduction sleep. clkIO stops, so Timer0
+    // (millis), Timer1 and Timer2 pause for the ~105us it takes. Must not be free running (halAdcStopFreeRunning first)
+    ADCSRA = _BV(ADEN) | _BV(ADIE) | _BV(ADIF) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);
+    ADCSRA |= _BV(ADSC);  // Started here rather than by sleeping, so an interrupt just before can't leave it unstarted
+    set_sleep_mode(SLEEP_MODE_ADC);
+    sleep_mode();
+}
+
+void halAdcOff() {
+    // ADC disabled to save power (halAdcStartFreeRunning/halAdcSingleAsleep turn it back on)
+    ADCSRA = 0;
+}
+
+void halWaitForInterrupt() {
+}
+
+void halSleep() {
+    // Idle sleep until the next interrupt (Timer0's millis tick at the latest, so ~1ms)
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    sleep_mode();
+}
+
+void halControlTimerBegin(uint8_t top) {
+    // Timer2 CTC mode, /128 prescaler, compare A interrupt every (top + 1)*8us
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        TCCR2A = _BV(WGM21);
+        TCCR2B = _BV(CS22) | _BV(CS20);
+        OCR2A = top;
+        TCNT2 = 0;
+        TIMSK2 |= _BV(OCIE2A);
+    }
+}
+
+void halControlTimerEnable(bool enable) {
+    // Compare A interrupt on/off (the timer keeps counting)
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if (enable) {
+            TIFR2 = _BV(OCF2A);
+            TIMSK2 |= _BV(OCIE2A);
+        } else {
+            TIMSK2 &= ~_BV(OCIE2A);
+        }
+    }
+}
+
+void halMotorPwmBegin(uint16_t top, uint8_t clockSelect, bool phaseCorrect) {
+    // Timer1 PWM with ICR1 as TOP (mode 10 phase correct, or 14 fast PWM), clock select 1-5 = /1 -> /1024. Outputs stay
+    // disconnected until a duty is written (PwmPin). Overflow interrupt once per PWM period
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        TCCR1B = 0;  // Stopped while it's set up
+        TCCR1A = _BV(WGM11);
+        ICR1 = top;
+        OCR1A = 0;
+        OCR1B = 0;
+        TCNT1 = 0;
+        TCCR1B = _BV(WGM13) | (phaseCorrect ? 0 : _BV(WGM12)) | clockSelect;
+        TIFR1 = _BV(TOV1);
+        TIMSK1 |= _BV(TOIE1);
+    }
+}
+
+void halMotorPwmEnable(bool enable) {
+    // Timer1 overflow interrupt on/off. Only the interrupt, the timer and its output carry on
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if (enable) {
+            TIFR1 = _BV(TOV1);
+            TIMSK1 |= _BV(TOIE1);
+        } else {
+            TIMSK1 &= ~_BV(TOIE1);
+        }
+    }
+}
+
+void halEepromWrite(uint16_t address, uint8_t value) {
+    // Start an erase + write of one byte (~3.3ms). Only from the EEPROM ready interrupt, where EEPE is known to be
+    // clear and interrupts are off for the timed EEMPE -> EEPE sequence
+    EEAR = address;
+    EEDR = value;
+    EECR |= _BV(EEMPE);
+    EECR |= _BV(EEPE);
+}
+
+void halEepromReadyInterrupt(bool enable) {
+    // EE_READY fires whenever no write is in progress, for as long as it is enabled
+    if (enable) {
+        EECR |= _BV(EERIE);
+    } else {
+        EECR &= ~_BV(EERIE);
+    }
+}
+
+#define HAL_ADC_INTERRUPT ISR(ADC_vect)
+#define HAL_CONTROL_INTERRUPT ISR(TIMER2_COMPA_vect)
+#define HAL_EEPROM_INTERRUPT ISR(EE_READY_vect)
+#ifdef BENCH
+#define HAL_MOTOR_PWM_INTERRUPT void halMotorPwmInterrupt()  // env:bench counts cycles with Timer1 (bench_main.cpp)
+#else
+#define HAL_MOTOR_PWM_INTERRUPT ISR(TIMER1_OVF_vect)
+#endif
+
+#else
+
+#include "sim/hal_native.h"
+
+#endif
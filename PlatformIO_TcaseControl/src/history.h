@@ -0,0 +1,166 @@
+#pragma once
+#include <Arduino.h>
+#include <EEPROM.h>
+#include "specifications.h"
+#include "sensors.h"
+#include "shiftlog.h"
+#include "journal.h"
+#include "cobs.h"
+#include "telemetry.h"
+
+// Shift history that survives power off
+// Every (outermost) shift appends a HistoryRecord (layout in cobs.h) + CRC to a ring of EEPROM_HISTORY_SLOTS in
+// EEPROM, and adds to the PairCounters for its from -> to pair. Both are written in the background by eepromWriter
+// (journal.h), like the position journal.
+// The pair's counters are read when the shift starts (through eepromWriter.read(), which can't race a background
+// write) and written back when it ends. The last pair's counters are kept in RAM, so a repeat of the same shift
+// doesn't read them back while they may still be queued. If the queue is too full for the record or the counters
+// when the shift ends they're kept here and queued by flush() (a scheduler task in main.cpp), or at the latest
+// before the next shift starts, so nothing is lost. A record or counter with a bad CRC (e.g. power lost
+// while writing) is skipped, or counted from zero again.
+// The 'h' command (main.cpp) sends the lot over Serial as COBS frames, oldest shift first, then the counters.
+// tools/telemetry_decode.cpp -H turns them into CSV.
+
+const uint8_t HISTORY_RECORD_SIZE = sizeof(HistoryRecord) + 1;
+const uint8_t COUNTERS_RECORD_SIZE = sizeof(PairCounters) + 1;
+
+class ShiftHistory {
+    private:
+        uint16_t sequence = 0;  // Of the next record
+        uint8_t slot = 0;  // Next record goes here (so it's also the oldest)
+        PairCounters counters;  // For the shift in progress
+        int8_t pairIndex = -1;  // Of counters (-1 = not counting this shift)
+        int8_t cachedPair = -1;  // counters holds what was last written for this pair
+        uint8_t pendingRecord[HISTORY_RECORD_SIZE];  // Record + CRC waiting for room in the write queue
+        bool recordPending = false;
+        uint8_t pendingCounters[COUNTERS_RECORD_SIZE];
+        int8_t pendingPair = -1;  // Counters waiting for room (-1 = none)
+
+        uint16_t slotAddress(uint8_t s) {
+            return EEPROM_HISTORY_START + (uint16_t)s*HISTORY_RECORD_SIZE;
+        }
+
+        uint16_t countersAddress(uint8_t index) {
+            return EEPROM_COUNTERS_START + (uint16_t)index*COUNTERS_RECORD_SIZE;
+        }
+
+        bool readChecked(uint16_t address, uint8_t *data, uint8_t length) {
+            // Reads length bytes + CRC, returns whether the CRC matched
+            eepromWriter.read(address, data, length);
+            return crc8(data, length) == eepromWriter.read(address + length);
+        }
+
+        void withCrc(uint8_t *record, const void *data, uint8_t length) {
+            memcpy(record, data, length);
+            record[length] = crc8(record, length);
+        }
+
+        int8_t pairFor(int from, int to) {
+            if (!isValid(from) || !isValid(to) || from == to) {
+                return -1;
+            }
+            return from*4 + to;
+        }
+
+    public:
+        void begin() {
+            // Find where the newest record is so the next one goes after it
+            bool found = false;
+            uint16_t newest = 0;
+            for (uint8_t s = 0; s < EEPROM_HISTORY_SLOTS; s++) {
+                HistoryRecord record;
+                if (!readChecked(slotAddress(s), (uint8_t *)&record, sizeof(record))) {
+                    continue;
+                }
+                if (!found || (int16_t)(record.sequence - newest) > 0) {
+                    found = true;
+                    newest = record.sequence;
+                    slot = s;
+                }
+            }
+            if (found) {
+                sequence = newest + 1;
+                slot = (slot + 1) % EEPROM_HISTORY_SLOTS;
+            }
+        }
+
+        bool flush() {
+            // Queue whatever end() couldn't. Returns true once nothing is waiting
+            if (recordPending && eepromWriter.write(slotAddress(slot), pendingRecord, HISTORY_RECORD_SIZE)) {
+                recordPending = false;
+                sequence++;
+                slot = (slot + 1) % EEPROM_HISTORY_SLOTS;
+            }
+            if (pendingPair >= 0 && eepromWriter.write(countersAddress(pendingPair), pendingCounters, COUNTERS_RECORD_SIZE)) {
+                pendingPair = -1;
+            }
+            return !recordPending && pendingPair < 0;
+        }
+
+        void start(int from, int to) {
+            while (!flush()) {  // Only if the queue was full at the end of the last shift and still is
+                halWaitForInterrupt();
+            }
+            pairIndex = pairFor(from, to);
+            if (pairIndex >= 0 && pairIndex != cachedPair) {
+                cachedPair = -1;
+                if (!readChecked(countersAddress(pairIndex), (uint8_t *)&counters, sizeof(counters))) {
+                    memset(&counters, 0, sizeof(counters));  // Never written (or corrupt)
+                }
+            }
+        }
+
+        void end(int from, int to, unsigned long durationMs, uint8_t retries, uint8_t stalls, uint8_t flags, uint16_t finalReading) {
+            HistoryRecord record;
+            record.sequence = sequence;
+            record.from = from;
+            record.to = to;
+            record.durationMs = min(durationMs, 65535UL);
+            record.retries = retries;
+            record.stalls = stalls;
+            record.flags = flags;
+            record.finalReading = finalReading;
+            withCrc(pendingRecord, &record, sizeof(record));
+            recordPending = true;
+
+            if (pairIndex >= 0) {
+                counters.shifts++;
+                counters.failed += !(flags & SHIFT_SUCCESS);
+                counters.retries += retries;
+                counters.recovered += (flags & SHIFT_RECOVERED) && counters.recovered < 255;
+                withCrc(pendingCounters, &counters, sizeof(counters));
+                pendingPair = pairIndex;
+                cachedPair = pairIndex;
+                pairIndex = -1;
+            }
+            flush();  // Whatever doesn't fit now is queued by a later flush()
+        }
+
+        void dump() {
+            // Blocking, for the 'h' Serial command
+            while (!flush() || eepromWriter.busy()) {  // So the dump includes the last shift
+                halWaitForInterrupt();
+            }
+            for (uint8_t i = 0; i < EEPROM_HISTORY_SLOTS; i++) {
+                TelemetryHistory packet;
+                packet.type = TELEMETRY_HISTORY;
+                if (readChecked(slotAddress((slot + i) % EEPROM_HISTORY_SLOTS), (uint8_t *)&packet.record, sizeof(packet.record))) {
+                    telemetry.sendNow((const uint8_t *)&packet, sizeof(packet));
+                }
+            }
+            for (uint8_t from = 0; from < 4; from++) {
+                for (uint8_t to = 0; to < 4; to++) {
+                    TelemetryCounters packet;
+                    packet.type = TELEMETRY_COUNTERS;
+                    packet.from = from;
+                    packet.to = to;
+                    int8_t index = pairFor(from, to);
+                    if (index >= 0 && readChecked(countersAddress(index), (uint8_t *)&packet.counters, sizeof(packet.counters))) {
+                        telemetry.sendNow((const uint8_t *)&packet, sizeof(packet));
+                    }
+                }
+            }
+        }
+};
+
+ShiftHistory shiftHistory;
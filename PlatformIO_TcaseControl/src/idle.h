@@ -0,0 +1,122 @@
+#pragma once
+#include <Arduino.h>
+#include "hal.h"
+#include "specifications.h"
+#include "sensors.h"
+#include "adc.h"
+#include "switch.h"
+#include "control.h"
+
+// Parked idle mode
+// Once the motor is where the selector says and nothing has changed for IDLE_QUIET_S, normal() hands over to
+// sleep(): background sampling, the control interrupt and the motor PWM interrupt stop and the CPU sleeps (idle
+// sleep, woken only by the millis tick), taking a single selector switch conversion in ADC noise reduction sleep
+// every IDLE_SAMPLE_MS. On waking the estimator starts over from fresh samples.
+// As soon as a sample is outside the current position's window (SWITCH_WINDOWS) background sampling restarts and
+// the switch state machine debounces the change as usual. Scheduler tasks keep running throughout.
+// Wake latency (last sample still in the window -> full rate sampling back with fresh buffers) is measured on every
+// wake. It's at most IDLE_SAMPLE_MS + ~5ms, which has to stay well inside the debounce time so parking never makes
+// a selection noticeably slower.
+
+const unsigned long IDLE_QUIET_MS = IDLE_QUIET_S*1000UL;
+const unsigned long IDLE_WAKE_MARGIN_MS = 10;  // Conversion + refilling the buffers, with room to spare
+static_assert(IDLE_SAMPLE_MS + IDLE_WAKE_MARGIN_MS < SW_DEBOUNCE_MS / 2, "IDLE_SAMPLE_MS too long for the switch debounce time");
+
+class IdleMode {
+    private:
+        uint8_t switchPin;
+        bool idle = false;
+        unsigned long quietSince = 0;
+        unsigned long lastSampleMs = 0;
+        unsigned long lastSampleUs = 0;  // Last sample that was still in the window
+        ReadingWindow window;
+        uint32_t wakes = 0;
+        uint32_t lastWakeUs = 0;
+        uint32_t maxWakeUs = 0;
+
+        void enter(int8_t position) {
+            window = SWITCH_WINDOWS[position];
+            adcSampler.stop();
+            motorControl.pause();
+            idle = true;
+            lastSampleMs = millis() - IDLE_SAMPLE_MS;  // Sample straight away
+            lastSampleUs = micros();
+        }
+
+    public:
+        void begin(uint8_t pin) {
+            switchPin = pin;
+            quietSince = millis();
+        }
+
+        void activity() {
+            // Something happened (or is about to), restart the quiet period
+            quietSince = millis();
+            wake();
+        }
+
+        bool sleep(int8_t position) {
+            // Called by normal() each time round while nothing needs doing, with where the knob physically is
+            // (SelectorSwitch::getConfirmedState(), not the selection: in Neutral that's the detent it sprang back
+            // to). Returns true while parked, false once awake (the caller carries on as normal)
+            if (!idle) {
+                if (!isValid(position) || millis() - quietSince < IDLE_QUIET_MS) {
+                    return false;
+                }
+                enter(position);
+            }
+            if (millis() - lastSampleMs < IDLE_SAMPLE_MS) {
+                halSleep();
+                return true;
+            }
+            lastSampleMs = millis();
+            reading_t reading = (reading_t)adcSampler.sampleAsleep(switchPin) << READING_SHIFT;
+            if (inWindow(reading, window)) {
+                lastSampleUs = micros();
+                return true;
+            }
+            activity();
+            return false;
+        }
+
+        void wake() {
+            // Back to full rate background sampling (nothing to do if not parked)
+            if (!idle) {
+                return;
+            }
+            idle = false;
+            adcSampler.start();
+            adcSampler.waitFresh();
+            motorControl.resume();
+            lastWakeUs = micros() - lastSampleUs;
+            maxWakeUs = max(maxWakeUs, lastWakeUs);
+            wakes++;
+        }
+
+        bool isIdle() {
+            return idle;
+        }
+
+        uint32_t getWakes() {
+            return wakes;
+        }
+
+        uint32_t getLastWakeUs() {
+            return lastWakeUs;
+        }
+
+        uint32_t getMaxWakeUs() {
+            return maxWakeUs;
+        }
+
+        void print() {
+            // For the 'i' Serial command
+            Serial.print(F("idle ")); Serial.print(idle ? 1 : 0);
+            Serial.print(F(" wakes ")); Serial.print(wakes);
+            Serial.print(F(" wake_us last ")); Serial.print(lastWakeUs);
+            Serial.print(F(" max ")); Serial.print(maxWakeUs);
+            Serial.print(F(" debounce_us ")); Serial.println(SW_DEBOUNCE_MS*1000);
+        }
+};
+
+IdleMode idleMode;
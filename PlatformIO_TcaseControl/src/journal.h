@@ -0,0 +1,166 @@
+#pragma once
+#include <Arduino.h>
+#include <EEPROM.h>
+#include "hal.h"
+#include "specifications.h"
+
+// Non-blocking EEPROM writes and the wear levelled position journal
+// A byte write stalls the CPU for ~3.3ms if it's done with EEPROM.write/update, so instead bytes are queued and the
+// EEPROM ready interrupt writes the next one each time the previous has finished. Callers never wait.
+// The position used to be rewritten in place at address 0. Now each change is appended to the next slot of a ring
+// of EEPROM_JOURNAL_SLOTS records (sequence number + position + CRC), so every cell sees 1/EEPROM_JOURNAL_SLOTS of
+// the writes. On boot the newest record with a good CRC wins, so a write cut short by power off just loses
+// that one change.
+
+const uint8_t EEPROM_QUEUE_BITS = 5;
+const uint8_t EEPROM_QUEUE_SIZE = 1 << EEPROM_QUEUE_BITS;  // Bytes waiting to be written (end of a shift queues 24)
+
+uint8_t crc8(const uint8_t *data, uint8_t length) {
+    // CRC-8, polynomial 0x07 (ATM)
+    uint8_t crc = 0;
+    for (uint8_t i = 0; i < length; i++) {
+        crc ^= data[i];
+        for (uint8_t bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+class EepromWriter {
+    private:
+        struct PendingByte {
+            uint16_t address;
+            uint8_t value;
+        };
+        PendingByte queue[EEPROM_QUEUE_SIZE];
+        volatile uint8_t head = 0;  // Only written by write()
+        volatile uint8_t tail = 0;  // Only written by the interrupt
+
+    public:
+        uint8_t space() {
+            return EEPROM_QUEUE_SIZE - 1 - (uint8_t)(head - tail);
+        }
+
+        bool write(uint16_t address, const uint8_t *data, uint8_t length) {
+            // Queue all of data or none of it (so a record is never half queued). Returns false if there isn't room
+            if (length > space()) {
+                return false;
+            }
+            uint8_t h = head;
+            for (uint8_t i = 0; i < length; i++) {
+                queue[h & (EEPROM_QUEUE_SIZE - 1)].address = address + i;
+                queue[h & (EEPROM_QUEUE_SIZE - 1)].value = data[i];
+                h++;
+            }
+            head = h;
+            halEepromReadyInterrupt(true);
+            return true;
+        }
+
+        bool busy() {
+            return head != tail;
+        }
+
+        uint8_t read(uint16_t address) {
+            // EEPROM.read with the EEPROM ready interrupt held off. avr-libc's eeprom_read_byte doesn't stop the
+            // interrupt starting a write between its EEPE check and setting EEAR, which would read garbage. Waits for
+            // a byte write already in progress (3.3ms at most), the rest of the queue carries on afterwards.
+            // Bytes still queued read as their old value, so callers keep their own copy of what they just wrote
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                halEepromReadyInterrupt(false);
+            }
+            uint8_t value = EEPROM.read(address);
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                if (busy()) {
+                    halEepromReadyInterrupt(true);
+                }
+            }
+            return value;
+        }
+
+        void read(uint16_t address, uint8_t *data, uint8_t length) {
+            for (uint8_t i = 0; i < length; i++) {
+                data[i] = read(address + i);
+            }
+        }
+
+        void nextFromISR() {
+            // EEPROM ready interrupt only (the previous write has finished)
+            if (head == tail) {
+                halEepromReadyInterrupt(false);
+                return;
+            }
+            PendingByte &next = queue[tail & (EEPROM_QUEUE_SIZE - 1)];
+            halEepromWrite(next.address, next.value);
+            tail++;
+        }
+};
+
+EepromWriter eepromWriter;
+
+HAL_EEPROM_INTERRUPT {
+    eepromWriter.nextFromISR();
+}
+
+const uint8_t JOURNAL_RECORD_SIZE = 4;  // Sequence (2 bytes, little endian), value, CRC of the first 3
+const uint8_t JOURNAL_MAX_VALUE = 5;  // Values are EEPROM position codes (see readEEPROMposition in motor.h)
+
+class PositionJournal {
+    private:
+        uint16_t sequence = 0;  // Of the next record
+        uint8_t slot = 0;  // Next record goes here
+        int16_t saved = -1;  // Value in the newest record (-1 = nothing in the journal yet)
+
+        uint16_t slotAddress(uint8_t s) {
+            return EEPROM_JOURNAL_START + (uint16_t)s*JOURNAL_RECORD_SIZE;
+        }
+
+    public:
+        bool begin() {
+            // Find the newest good record. Returns false if there isn't one (new chip, or only the old single byte)
+            bool found = false;
+            uint16_t newest = 0;
+            for (uint8_t s = 0; s < EEPROM_JOURNAL_SLOTS; s++) {
+                uint8_t record[JOURNAL_RECORD_SIZE];
+                eepromWriter.read(slotAddress(s), record, JOURNAL_RECORD_SIZE);
+                if (record[2] > JOURNAL_MAX_VALUE || crc8(record, JOURNAL_RECORD_SIZE - 1) != record[3]) {
+                    continue;  // Erased, torn or not a record
+                }
+                uint16_t seq = record[0] | (record[1] << 8);
+                if (!found || (int16_t)(seq - newest) > 0) {  // (Wraps, the journal only ever holds SLOTS consecutive numbers)
+                    found = true;
+                    newest = seq;
+                    saved = record[2];
+                    slot = s;
+                }
+            }
+            if (found) {
+                sequence = newest + 1;
+                slot = (slot + 1) % EEPROM_JOURNAL_SLOTS;
+            }
+            return found;
+        }
+
+        int16_t get() {
+            return saved;
+        }
+
+        void save(uint8_t value) {
+            // Only changes are written, so this is cheap enough to call on every reading.
+            // If the write queue is full it's left for the next call
+            if (value == saved) {
+                return;
+            }
+            uint8_t record[JOURNAL_RECORD_SIZE] = {(uint8_t)(sequence & 0xFF), (uint8_t)(sequence >> 8), value, 0};
+            record[3] = crc8(record, JOURNAL_RECORD_SIZE - 1);
+            if (!eepromWriter.write(slotAddress(slot), record, JOURNAL_RECORD_SIZE)) {
+                return;
+            }
+            saved = value;
+            sequence++;
+            slot = (slot + 1) % EEPROM_JOURNAL_SLOTS;
+        }
+};
+
+PositionJournal positionJournal;
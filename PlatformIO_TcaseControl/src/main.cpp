@@ -8,6 +8,12 @@
 #include "motor.h"
 #include "switch.h"
 #include "output.h"
+#include "scheduler.h"
+#include "adc.h"
+#include "shiftlog.h"
+#include "profiler.h"
+#include "telemetry.h"
+#include "idle.h"
 
 // #define DEBUG
 
@@ -20,11 +26,10 @@
 #endif
 
 // PINS
-const uint8_t TFT_CS = 10, TFT_DC = 9, TFT_RST = 8; 
+// TFT CS/DC are plain GPIO, kept off Timer1's outputs: 9 (OC1A) is the motor PWM (MOTOR_PWM_PIN). 10 (OC1B) is SS,
+// which has to be an output for the SPI master anyway, and OC1B is left disconnected
+const uint8_t TFT_CS = 10, TFT_DC = 6, TFT_RST = 8; 
 const uint8_t switchModePin = A0;
-const uint8_t motorPWMpin = 6;
-const uint8_t motorDirPin = 7;
-const uint8_t brakeReleasePin = 4;
 const uint8_t manualDirectionPin = 2;
 const uint8_t manualDrivePin = 3;
 
@@ -36,19 +41,134 @@ const uint8_t motorModePin = A1;
 Adafruit_ST7789 tft = Adafruit_ST7789(TFT_CS, TFT_DC, TFT_RST);
 
 
-// int SWITCH_FIXED_RESISTOR = 4555;  // Resistance of fixed resistor for detecing mode select resistance in ohms
-int SWITCH_FIXED_RESISTOR = 4675;  // Resistance of fixed resistor for detecting mode select resistance in ohms
-
 bool manualMode = false;
+bool calibrationRequested = false;
+
+const unsigned long SWITCH_POLL_MS = 10;  // How often the selector is sampled by the scheduler
+const unsigned long SERIAL_POLL_MS = 50;  // How often Serial is checked for commands
+const unsigned long TELEMETRY_FLUSH_MS = 4;  // Serial's 64 byte TX buffer takes ~5.5ms to empty at 115200
+const unsigned long MOTOR_MODEL_SAVE_MS = 1000;
+const unsigned long HISTORY_SAVE_MS = 100;  // Retry for shift history that didn't fit in the EEPROM write queue
 
 
 // OtherOutputs output = OtherOutputs(&tft, fakeSwitchPin, fakeMotorPin);  // TODO: Add backLightPin and some backlight control
 OtherOutputs output = OtherOutputs(&tft);  // TODO: Add backLightPin and some backlight control
-SelectorSwitch selector = SelectorSwitch(switchModePin, &output, SWITCH_FIXED_RESISTOR);
+SelectorSwitch selector = SelectorSwitch(switchModePin, &output);  // Fixed resistor value is in specifications.h
 // Motor motor = Motor(motorPWMpin, motorDirPin, brakeReleasePin, motorModePin, vOutRead, &output);
-Motor motor = Motor(motorPWMpin, motorDirPin, brakeReleasePin, motorModePin, &output);
+Motor motor = Motor(motorModePin, &output);
 int currentPosition = -1;  // Current position of Motor
 byte desiredPosition = 1;
+
+// RAM: the ATmega328 has 2048 bytes for .data, .bss and the stack. The Arduino core (Serial's buffers are 128 of it),
+// the display library and the stack need the rest, so the firmware's own objects have to stay under this.
+// Estimated at ~1100 bytes from the struct layouts; tools/bench.sh prints the real total. (Only checked with AVR type
+// sizes, host builds are bigger)
+const unsigned int FIRMWARE_RAM_BUDGET = 1280;
+static_assert(sizeof(void *) != 2 || sizeof(adcSampler) + sizeof(calibration) + sizeof(motorControl) + sizeof(feedForward) + sizeof(shiftHistory)
+  + sizeof(idleMode) + sizeof(eepromWriter) + sizeof(positionJournal) + sizeof(motorPwm) + sizeof(scheduler)
+  + sizeof(shiftLog) + sizeof(telemetry) + sizeof(messageBuffer) + sizeof(output) + sizeof(selector) + sizeof(motor)
+  <= FIRMWARE_RAM_BUDGET, "Firmware objects over FIRMWARE_RAM_BUDGET, not enough RAM left for the stack");  // (profiler isn't counted, env:uno_profile has ~280 bytes less stack)
+
+/**
+ * Scheduler task: draw any display changes (setters on output only mark things dirty)
+ */
+void renderDisplay() {
+  output.render();
+}
+
+/**
+ * Scheduler task: keep watching the selector, even while the motor is busy shifting
+ */
+void pollSwitch() {
+  selector.checkState();
+  if (motor.isShifting() && selector.getLastValidState() != motor.getRequestedPos()) {
+    motor.requestAbort();  // Selection changed mid shift, stop and let normal() start a shift to the new selection
+  }
+}
+
+/**
+ * Send one of the blocking Serial dumps ('l', 'h' or 'p'). They take up to ~100ms at 115200
+ */
+void sendDump(char command) {
+  switch (command) {
+    case 'l':
+      shiftLog.print();
+      break;
+    case 'h':
+      shiftHistory.dump();
+      break;
+    case 'p':
+      PROFILE_PRINT();
+      break;
+  }
+}
+
+/**
+ * Scheduler task: single character commands over Serial (115200)
+ *   l - print timings of the recent shifts (see shiftlog.h)
+ *   p - print profiler results, r - reset them (only when built with PROFILE, see profiler.h)
+ *   t - start/stop the binary telemetry stream (see telemetry.h)
+ *   h - send the stored shift history and counters (binary, see history.h)
+ *   c - calibrate the mode sensor positions (runs from normal() once the current shift is done, see calibration.h)
+ *   i - print idle mode state and the measured wake latency (see idle.h)
+ * This task also runs inside scheduler.wait() during a shift, so the dumps (l, h, p) wait until the motor is idle
+ * rather than holding up the shift while Serial drains
+ */
+void pollSerial() {
+  static char pendingDump = 0;
+  bool shifting = motor.isShifting() || motorControl.isActive();
+  if (pendingDump != 0 && !shifting) {
+    sendDump(pendingDump);
+    pendingDump = 0;
+  }
+  while (Serial.available() > 0) {
+    char command = Serial.read();
+    switch (command) {
+      case 'l':
+      case 'h':
+      case 'p':
+        if (shifting) {
+          pendingDump = command;  // (Only the last one asked for)
+        } else {
+          sendDump(command);
+        }
+        break;
+      case 'r':
+        PROFILE_RESET();
+        break;
+      case 't':
+        telemetry.setEnabled(!telemetry.isEnabled());
+        break;
+      case 'c':
+        calibrationRequested = true;
+        break;
+      case 'i':
+        idleMode.print();
+        break;
+    }
+  }
+}
+
+/**
+ * Scheduler task: pass queued telemetry packets to Serial (never blocks)
+ */
+void flushTelemetry() {
+  telemetry.flush();
+}
+
+/**
+ * Scheduler task: store the learned motor model once it has changed (see feedforward.h)
+ */
+void saveMotorModel() {
+  feedForward.saveIfChanged();
+}
+
+/**
+ * Scheduler task: queue any shift history the end of the last shift couldn't (see history.h)
+ */
+void saveShiftHistory() {
+  shiftHistory.flush();
+}
   
 void blink() {
   pinMode(LED_BUILTIN, OUTPUT);
@@ -61,51 +181,54 @@ void blink() {
 }
 
 void waitUntilLongNpress() {
-  unsigned long time;
+  const unsigned long RESET_PRESS_MS = 5000;
   const char msg[] PROGMEM = "WARNING: Motor position is not valid. Hold N for 5s to reset";
   output.setMainMessage(msg);
-  while (1) {  // Keep looping through this until N is pressed for duration_s
-      while (selector.getSwitchPosition() != NEUTRAL) {
-          motor.getPosition();
-          delay(10);
-      }
-      time = millis();
-      output.setMainMessage(F("N pressed"));
-      while (millis() - time < 5*1000 && selector.getSwitchPosition() == NEUTRAL) {
-          motor.getPosition();
-          delay(10);
-      }
-      if (millis() - time > 5*1000) {
+  selector.setNeutralReset(true);  // Neutral presses are just timed here, no toggling
+  bool pressed = false;
+  while (1) {  // Keep looping through this until N is pressed for RESET_PRESS_MS
+      selector.checkState();
+      motor.getPosition();
+      unsigned long held = selector.neutralHeldMs();
+      if (held >= RESET_PRESS_MS) {
           break;
-      } else {
+      } else if (held > 0 && !pressed) {
+          pressed = true;
+          output.setMainMessage(F("N pressed"));
+      } else if (held == 0 && pressed) {
+          pressed = false;
           output.setMainMessage(F("N released early"));
-          delay(500);
+          scheduler.wait(500);
           output.setMainMessage(msg);
       }
+      scheduler.wait(10);
   }
   output.setMainMessage(F("Reset Successful. Release N"));
-  while (selector.getSwitchPosition() == NEUTRAL) {
+  while (selector.neutralHeldMs() > 0) {
+    selector.checkState();
     motor.getPosition();
-    delay(10);
+    scheduler.wait(10);
   }
+  selector.setNeutralReset(false);
   output.setMainMessage(F(""));
 }
 
 void waitUntilReset() {
   output.setMainMessage(F("State requires reset: Put switch in motor position"));
   while (selector.getSelection() != motor.getValidPosition()) {
-    delay(10);
+    scheduler.wait(10);
   }
   if (!isValid(motor.getPosition())) { 
     waitUntilLongNpress();
   }
   output.setMainMessage(F("Reset successful"));
-  delay(1000);
+  scheduler.wait(1000);
   output.setMainMessage(F(""));
 }
 
 int analogDisconected(const uint8_t pin) {
   int disconnected = 0;
+  adcSampler.stop();  // Background sampling has to be paused to use analogRead
   pinMode(pin, INPUT_PULLUP);
   delay(50);
   analogRead(pin);  // Apparently first few reads after switching mode can be bad
@@ -120,15 +243,14 @@ int analogDisconected(const uint8_t pin) {
   analogRead(pin);  // Apparently first few reads after switching mode can be bad
   analogRead(pin);
   analogRead(pin);
+  adcSampler.start();
   return disconnected;
 }
 
 void normal_setup() {
-  #ifdef DEBUG
-    Serial.begin(115200); 
-    DEBUG_PRINTLN(F("Main: Booting"));
-  #endif
+  DEBUG_PRINTLN(F("Main: Booting"));
   randomSeed(analogRead(A5));  // Makes random() change between boots
+  adcSampler.begin(switchModePin, motorModePin, SWITCH_OVERSAMPLE_BITS, MODE_OVERSAMPLE_BITS);
   output.begin();
   delay(3000); // Some time for output bootup display to show
   motor.begin();
@@ -136,15 +258,15 @@ void normal_setup() {
   if (analogDisconected(motorModePin)) {
     output.setMainMessage(F("Motor Disconnected: Waiting for reconnect"));
     selector.begin(0);
-    delay(2000);
+    scheduler.wait(2000);
     while (analogDisconected(motorModePin)) {
       selector.readOnly();
-      delay(10);
+      scheduler.wait(10);
       motor.getPosition();
-      delay(10);
+      scheduler.wait(10);
     }
     output.setMainMessage(F("Motor Reconnected: Continuing in 60s"));
-    delay(60000);
+    scheduler.wait(60000);
     output.setMainMessage(F(""));
   }
 
@@ -167,10 +289,15 @@ void normal_setup() {
   if (selector.getSelection() != motor.getPosition()) {
     waitUntilReset(); // Prevent a shift occuring immediately after startup without input
   }
+  scheduler.addPeriodic(pollSwitch, SWITCH_POLL_MS);
+  scheduler.addPeriodic(saveMotorModel, MOTOR_MODEL_SAVE_MS);
+  scheduler.addPeriodic(saveShiftHistory, HISTORY_SAVE_MS);
+  idleMode.begin(switchModePin);
 }
 
 void readOnly_setup() {
   randomSeed(analogRead(A5));  // Makes random() change between boots
+  adcSampler.begin(switchModePin, motorModePin, SWITCH_OVERSAMPLE_BITS, MODE_OVERSAMPLE_BITS);
   output.begin();
   motor.begin();
   selector.begin(0);
@@ -181,33 +308,57 @@ void manualControlSetup() {
   pinMode(manualDirectionPin, INPUT_PULLUP);
 
   randomSeed(analogRead(A5));  // Makes random() change between boots
+  adcSampler.begin(switchModePin, motorModePin, SWITCH_OVERSAMPLE_BITS, MODE_OVERSAMPLE_BITS);
   output.begin();
   delay(300); // Some time for output bootup display to show
   motor.begin();
+  PWM_MAX_POWER = 255;  // Might as well have access to full power if in Manual mode.
+  feedForward.scaleDuty();  // duty() is scaled to PWM_MAX_POWER, so it has to follow
 
   output.setMainMessage(F("Manual Mode Enabled"));
   selector.begin(0);
-  delay(1000);
+  scheduler.wait(1000);
   while (digitalRead(manualDrivePin) == LOW) {
     output.setMainMessage(F("Release Drive Button"));
+    scheduler.run();
   }
 }
 
 
 void testSwitch() {
   desiredPosition = selector.getSelection();
-  delay(1000); 
+  scheduler.wait(1000); 
 }
 
 void normal() {
   bool success = false;
+  if (calibrationRequested) {
+    idleMode.activity();
+    calibrationRequested = false;
+    motor.calibrate();
+    calibration.print();
+    scheduler.wait(1000);
+    output.setMainMessage(F(""));  // Next normal() shifts back to the selection
+  }
+  if (idleMode.sleep(selector.getConfirmedState())) {
+    return;  // Parked, the switch is sampled at a low rate until it moves
+  }
   desiredPosition = selector.getSelection();
+  if (!selector.isSettled() || motor.getPosition() != desiredPosition) {
+    idleMode.activity();
+  }
   if (motor.getPosition() != desiredPosition) {
     success = motor.attemptShift(desiredPosition, MAX_SINGLE_SHIFT_ATTEMPTS);
-    if (success) {
+    if (success && feedForward.isWeak()) {
+      output.setMainMessage(F("Shift OK: motor getting weak"));
+      scheduler.wait(1000);
+      output.setMainMessage(F(""));
+    } else if (success) {
       output.setMainMessage(F("Shift completed successfully"));
-      delay(1000);
+      scheduler.wait(1000);
       output.setMainMessage(F(""));
+    } else if (motor.shiftAborted()) {
+      DEBUG_PRINTLN(F("Main: Selection changed during shift"));  // Next normal() shifts toward the new selection
     } else {
       DEBUG_PRINTLN(F("Main: Failed to reach position"));
       waitUntilReset();
@@ -219,11 +370,10 @@ void readOnly() {
     output.setMainMessage(F("Read Only Mode"));
     selector.getSelection();
     motor.getPosition();
-    delay(500);
+    scheduler.wait(500);
 }
 
 void manualControl() {
-  PWM_MAX_POWER = 255;  // Might as well have access to full power if in Manual mode.
   int dirRead = digitalRead(manualDirectionPin);
   int dir = 0;
   char msg[30];
@@ -248,13 +398,14 @@ void manualControl() {
     unsigned long startTime = millis();
     while (digitalRead(manualDrivePin) == LOW && millis() - startTime < 5000) { // Button pressed
       motor.manualDrive(dir);
+      scheduler.run();
     } 
     motor.manualStop();
 
     if (digitalRead(manualDrivePin) == LOW) { // Button still pressed (Prevent next loop until released)
       output.setMainMessage(F("Release Manual Drive"));
       while (digitalRead(manualDrivePin) == LOW) {
-        delay(10);
+        scheduler.wait(10);
       }
     }
   }
@@ -266,6 +417,11 @@ void manualControl() {
 void setup() {
   // normal_setup();
   // readOnly_setup();
+  Serial.begin(115200);
+  scheduler.addPeriodic(renderDisplay, 1000/DISPLAY_FRAME_RATE_HZ);  // Does nothing until output.begin()
+  scheduler.addPeriodic(pollSerial, SERIAL_POLL_MS);
+  telemetry.begin(switchModePin, motorModePin);
+  scheduler.addPeriodic(flushTelemetry, TELEMETRY_FLUSH_MS);
   pinMode(manualDrivePin, INPUT_PULLUP);
   delay(1);
   if (digitalRead(manualDrivePin) == LOW) { // Then booting with manual override
@@ -279,8 +435,10 @@ void setup() {
  * Runs repeatedly after Arduino setup()
  */
 void loop() {
+  PROFILE_SCOPE(PROF_LOOP);
   // readOnly();
   // testSwitch();
+  scheduler.run();
   if (manualMode == true) {
     manualControl();
   } else {
@@ -2,6 +2,16 @@
 #include <Arduino.h>
 #include "output.h"
 #include "specifications.h"
+#include "scheduler.h"
+#include "adc.h"
+#include "sensors.h"
+#include "control.h"
+#include "shiftlog.h"
+#include "profiler.h"
+#include "telemetry.h"
+#include "journal.h"
+#include "history.h"
+#include "calibration.h"
 #include <EEPROM.h>
 
 #ifdef DEBUG
@@ -21,13 +31,12 @@
 #define LO_POS 3
 #define MANUAL_POS 10
 
-#define TOWARD_4HI -1
-#define TOWARD_4LO 1
 
 char m_buf[100];  // DEBUGGING: string buffer to avoid use of String
 
 int readEEPROMposition() {
-    int pos = EEPROM.read(EEPROM_POSITION_ADDRESS);
+    // Newest position in the journal (see journal.h), or the single byte older firmware kept at EEPROM_POSITION_ADDRESS
+    int pos = positionJournal.begin() ? positionJournal.get() : eepromWriter.read(EEPROM_POSITION_ADDRESS);
     if (pos >= 0 && pos <= 3) {
         return pos;
     } else {
@@ -55,48 +64,103 @@ void setEEPROMposition(int pos) {
         }
 
     }
-    EEPROM.update(EEPROM_POSITION_ADDRESS, pos);  // Save in EEPROM for next time vehicle turns on
+    PROFILE_SCOPE(PROF_EEPROM_WRITE);
+    positionJournal.save(pos);  // Save in EEPROM for next time vehicle turns on (only if changed, written in the background)
 }
 
+// Stages of a shift (see Motor::runShift). Each pass of the shift loop does one step of the current stage and then
+// lets the scheduler run, so the display, switch and sensor checks carry on during the brake waits as well
+enum ShiftStage : uint8_t {
+    STAGE_RELEASE,  // Brake coming off. Mode sensor is checked meanwhile and the motor starts as soon as both are ready
+    STAGE_MOVE,  // Control interrupt driving toward the target
+    STAGE_RETRY,  // Stopped after a stall/timeout, waiting to try again
+    STAGE_APPLY,  // Motor off, brake goes on once the shaft has stopped moving
+    STAGE_DONE
+};
+
+constexpr reading_t SENSOR_LOW_R = voltsToReadingFloor(LOW_LIMIT);
+constexpr reading_t SENSOR_HIGH_R = voltsToReadingFloor(HIGH_LIMIT);
+constexpr reading_t STEADY_BAND_R = voltsToReadingFloor(BRAKE_STEADY_BAND_V);
+
 class Motor {
     private:
         int lastValidPos = 5; // Properly set in .begin()
         int currentPos = 5;  // Properly set in .begin() 
         byte brakeState = ON; // By default the brake is ON and must be disabled by setting brakePin HIGH
-        float motorSpeed = 0.0; // 0.0 - 1.0
-        int motorDirection = 0;  // -1, 0, 1 (0 for not moving)
         int singleShiftAttempts = 0;  
+        unsigned long retryCount = 0;  // Retries since boot (all shifts)
+        uint8_t stallCount = 0;  // Retries started by stall detection during the current/last shift
+        bool shifting = false;  // True for the whole of an attemptShift (including any recovery shift)
+        int requestedPos = 5;  // Position the outermost attemptShift was asked for
+        volatile bool abortRequested = false;  // Set from a scheduler task when the selection changes mid shift
+        bool recovered = false;  // tryRecoverBadShift ran during the current/last shift
         unsigned long shiftStart;
-        unsigned long lastMotorSetTime = millis();  // Last time motor speed was updated
-        uint8_t dirPin;
-        uint8_t pwmPin;
-        uint8_t brakeReleasePin;
-        uint8_t modePin;
+        ShiftStage stage = STAGE_DONE;
+        unsigned long stageStart = 0;
+        unsigned long steadySince = 0;  // Mode sensor in range and within STEADY_BAND_R of steadyReading since then
+        reading_t steadyReading = 0;
+        reading_t targetReading = 0;  // Of the shift in progress
+        reading_t targetTolerance = 0;
+        unsigned long lastControlTime = 0;  // micros() at the start of the previous shift loop iteration (0 = none yet)
+        unsigned long maxControlPeriodUs = 0;  // Worst shift loop period seen during the current/last shift
+        uint8_t modePin;  // Driver outputs are MOTOR_PWM_PIN, MOTOR_DIR_PIN and BRAKE_RELEASE_PIN (specifications.h)
         // uint8_t vOutPin;
         OtherOutputs *output;
 
-        void initializeShift() {
-            output->setMainMessage(F("Initializing Shift"));  // DEBUGGING
-            DEBUG_PRINTLN("Motor>initializeShift: Initializing Shift");  // DEBUGGING
+        void setStage(ShiftStage newStage) {
+            stage = newStage;
+            stageStart = millis();
+            steadySince = stageStart;
+            steadyReading = motorControl.estimatedPosition();
+            switch (newStage) {
+                case STAGE_RELEASE:
+                    output->setMainMessage(F("Initializing Shift"));  // DEBUGGING
+                    shiftLog.enter(PHASE_BRAKE_OFF);
+                    setBrake(OFF);
+                    break;
+                case STAGE_MOVE:
+                    shiftStart = stageStart;
+                    lastControlTime = 0;  // Don't count the brake/retry wait as a loop period
+                    motorControl.start(targetReading, targetTolerance);  // Speed/direction are updated by the control interrupt from here
+                    break;
+                case STAGE_RETRY:
+                    shiftLog.enter(PHASE_RETRY);
+                    break;
+                case STAGE_APPLY:
+                    stopMotor();
+                    shiftLog.enter(PHASE_BRAKE_ON);
+                    output->setRealtime(false);
+                    DEBUG_PRINT(F("Motor>runShift: Worst control loop period (us) = ")); DEBUG_PRINTLN(maxControlPeriodUs);
+                    break;
+                case STAGE_DONE:
+                    setBrake(ON);
+                    shiftLog.enter(PHASE_VERIFY);
+                    break;
+            }
+        }
 
-            singleShiftAttempts = 0;
-            setBrake(OFF); 
-            delay(BRAKE_RELEASE_TIME_S*1000);  // TODO might want to change these delays to check other things in the meantime
-            lastMotorSetTime = millis();  // Reset the time so that first set doesn't think it was ages ago.
-            shiftStart = millis();
-            output->setMainMessage("");  
+        unsigned long steadyMs() {
+            // How long the mode sensor has been in range and not moving (the estimator's velocity is too noisy for
+            // this, so it's the filtered position staying within STEADY_BAND_R)
+            reading_t reading = readPosition();  // (Also keeps the displayed voltage current)
+            reading_t filtered = motorControl.estimatedPosition();
+            reading_t moved = (filtered > steadyReading) ? filtered - steadyReading : steadyReading - filtered;
+            unsigned long now = millis();
+            if (reading < SENSOR_LOW_R || reading > SENSOR_HIGH_R || moved > STEADY_BAND_R) {
+                steadySince = now;
+                steadyReading = filtered;
+            }
+            return now - steadySince;
         }
 
-        bool endShift(int desiredPos){
-            // Returns whether shift ended successfully (i.e. reached desired or not)
-            DEBUG_PRINTLN(F("Motor>endShift: Shift ending"));
-            stopMotor();
-            delay(BRAKE_RELEASE_TIME_S*1000);
-            setBrake(ON);
-            if (getPosition() == desiredPos) {
-                return true;
+        void markControlTick() {
+            // Measure the shift loop period. Motor speed is set by the control interrupt so this no longer affects the ramp,
+            // but it is how quickly a timeout or a change of selection gets acted on
+            unsigned long now = micros();
+            if (lastControlTime != 0) {
+                maxControlPeriodUs = max(maxControlPeriodUs, now - lastControlTime);
             }
-            return false;
+            lastControlTime = now;
         }
 
         int checkShiftTimeout() {
@@ -110,6 +174,14 @@ class Motor {
             }
         }
 
+        unsigned long retryWaitMs(bool stalled) {
+            // A stall is noticed quickly so back off exponentially from a short wait, a timeout already took MAX_SHIFT_TIME_S
+            if (stalled) {
+                return (unsigned long)STALL_RETRY_MS << (singleShiftAttempts - 1);
+            }
+            return RETRY_TIME_S*1000;
+        }
+
         void setLastValidPos(int pos) {
             // sets the variable but also writes to EEPROM so that it can be loaded on next bootup
             lastValidPos = pos;
@@ -117,39 +189,26 @@ class Motor {
         }
 
         /**
-         * Read position of mode sensor in Volts
+         * Read position of mode sensor (fixed point reading, see sensors.h)
          */
-        float readPositionVolts() {
-            analogRead(modePin); // Throw away reading to make sure the next ones aren't affected by previous readings
-            float Vin = 5.0;
-            float volts = 0.0;
-            // Basic Average ////////
-            for (int i=0; i<10; i++) {
-                volts += Vin*analogRead(modePin)/1023;  // ~100us per read
-            } 
-            volts = volts/10.0;  // Because of averaging
-            ///////////////////////
-            // Exponetial Average ///////////// (less prone to spikes)
-            // volts = analogRead(modePin);
-            // const float alpha = 0.1;  // Lower more stable but slower to vary
-            // for (int i=0; i<10; i++) {
-            //     volts = (alpha*analogRead(modePin)+(1-alpha)*volts);
-            // }
-            // volts = Vin*volts/1023;
-            //////////////////////////////////
-            output->setMotorVolts(volts);
-            DEBUG_PRINT(F("Motor>readPositionVolts: Reading = ")); DEBUG_PRINTLN(volts);
-            return volts;
-        }
-
-        float getPositionVolts(int position) {
+        reading_t readPosition() {
+            // Average of the last 4^MODE_OVERSAMPLE_BITS samples taken in the background by adcSampler
+            PROFILE_SCOPE(PROF_ADC_READ);
+            reading_t reading = adcSampler.getReading(modePin);
+            output->setMotorReading(reading);
+            DEBUG_PRINT(F("Motor>readPosition: Reading = ")); DEBUG_PRINTLN(reading);
+            return reading;
+        }
+
+        reading_t getPositionReading(int position) {
+            // Learned plateau if calibrated, otherwise from specifications.h (see calibration.h)
             switch (position){
-                case LOCK_POS: return LOCK_V;
-                case AWD_POS: return AWD_V;
-                case N_POS: return N_V;
-                case LO_POS: return LO_V;
-                case MANUAL_POS: return 10.0;  // For manual override use (ensures distance to "desired" position stays large)
-                default: return AWD_V; // Safest to assume AWD if bad position passed
+                case LOCK_POS:
+                case AWD_POS:
+                case N_POS:
+                case LO_POS: return calibration.target(position);
+                case MANUAL_POS: return 0xFFFF;  // For manual override use (ensures distance to "desired" position stays large)
+                default: return calibration.target(AWD_POS); // Safest to assume AWD if bad position passed
             }
         }
 
@@ -160,6 +219,7 @@ class Motor {
 
         void addShiftAttempt() {
             singleShiftAttempts += 1;
+            retryCount += 1;
         }
 
         void setBrake(int brake) {
@@ -167,106 +227,33 @@ class Motor {
             // 1 for brake ON (Which is actually brakePin low to leave brake on)
             if (brake == OFF || brake == ON) {
                 brakeState = brake;
+                telemetry.setBrake(brakeState == ON);
                 DEBUG_PRINT(F("Motor>setBrake: Setting brake pin to ")); DEBUG_PRINT((1-brakeState)); DEBUG_PRINT(F(" to achieve brake state " )); DEBUG_PRINTLN(brakeState); 
-                digitalWrite(brakeReleasePin, 1-brakeState);  // (1-X) because the brake is ON by default and HIGH turns it OFF. 
-            }
-        }
-
-        void stepShiftSpeed(int direction, int desiredPos) {
-            // Update motor power based on current state.
-            // increase power if not at max and not close to desired pos
-            // decrease power if close to desired pos
-            float timeSinceLastSet = (float)min(millis() - lastMotorSetTime, (unsigned long)50)/1000.0;  // Smaller of true time elapsed or 50ms
-
-            DEBUG_PRINT(F("Motor>stepShiftSpeed: T=")); DEBUG_PRINT(timeSinceLastSet); DEBUG_PRINT(F(", speed=")); DEBUG_PRINT(motorSpeed); DEBUG_PRINT(F(", direction=")); DEBUG_PRINTLN(direction); 
-            if (timeSinceLastSet*PWM_FREQUENCY > 5.0) {  // More than 5 full duty cycles
-                if (motorDirection != 0 && direction != motorDirection) {  // Change of direction!! 
-                    motorSpeed = 0.0;
-                    stopMotor();
-                    delay(100);  // Enforce some delay
-                    timeSinceLastSet = 0.05;  // Don't want to step really fast because it's been a long time since last motor set time
-                }
-                motorDirection = direction;
-                updateMotorSpeed(desiredPos, timeSinceLastSet);
-            }
-        }
-
-        void updateMotorSpeed(int desiredPos, float timeElapsed) {
-            float posDist = desiredPositionDistance(desiredPos);
-            float maxAllowedSpeed;
-            if (posDist > 0.5) {
-                maxAllowedSpeed = 1.0;
-            } else if (posDist > 0.4) {
-                maxAllowedSpeed = 0.5;
-            } else if (posDist > 0.3) {
-                maxAllowedSpeed = 0.3;
-            } else if (posDist > 0.1) {
-                maxAllowedSpeed = 0.1;
-            } else {
-                maxAllowedSpeed = 0.01;  // I.e. min speed
-            }
-
-            float newSpeed = motorSpeed + PWM_ACCELERATION * timeElapsed;  // New porportional speed
-            newSpeed = min(maxAllowedSpeed, newSpeed);
-            if (abs(newSpeed - motorSpeed) > 0.0001) {  // If speed change required
-                motorSpeed = newSpeed;
-                DEBUG_PRINT(F("Motor>updateMotorSpeed: newSpeed = ")); DEBUG_PRINTLN(newSpeed);
-                setMotor();
+                FastPin<BRAKE_RELEASE_PIN>::write(brakeState == OFF);  // (1-X) because the brake is ON by default and HIGH turns it OFF. 
             }
         }
 
         void stopMotor() {
-            motorSpeed = 0.0;
-            motorDirection = 0;
-            setMotor();
-        }
-
-        void setMotor() {
-            if (brakeState == OFF && motorSpeed > 0.0 && (motorDirection == TOWARD_4LO || motorDirection == TOWARD_4HI)) {
-                int realDir, realPwm;
-                realDir = (motorDirection > 0) ? 1 : 0;
-                realPwm = max(PWM_MAX_POWER*motorSpeed, PWM_MIN_POWER);
-                // snprintf(m_buf, sizeof(m_buf), "Motor>setMotor: Dir = %i, Speed: %i", realDir, realPwm); DEBUG_PRINTLN(m_buf);  // DEBUGGING
-                digitalWrite(dirPin, realDir);
-                analogWrite(pwmPin, realPwm);
-            } else { // Stop motor
-                DEBUG_PRINTLN(F( "Motor>setMotor: Dir = 0, Speed: 0")); // DEBUGGING
-                digitalWrite(dirPin, 0);
-                digitalWrite(pwmPin, 0);
-            }
-            lastMotorSetTime = millis();
-        }
-
-        float desiredPositionDistance(int desiredPos) {
-            // Return distance to desired position
-            float currentPosVolts = readPositionVolts();
-            float desiredPosVolts = getPositionVolts(desiredPos);
-            return min(1.0, abs(currentPosVolts - desiredPosVolts));
+            motorControl.stop();
         }
 
-        int desiredPositionDirection(int desiredPos) {
-            // Return direction of desired position from current position
-            float currentPosVolts = readPositionVolts();
-            float desiredPosVolts = getPositionVolts(desiredPos);
-
-            if (currentPosVolts <= desiredPosVolts) { // Direction toward 4HI
-                DEBUG_PRINTLN(F("Motor>desiredPositionDirection: direction = -1"));
-                return TOWARD_4HI;  
-            } else {  // Direction toward 4LO
-                DEBUG_PRINTLN(F("Motor>desiredPositionDirection: direction = 1"));
-                return TOWARD_4LO;
-            }
+        reading_t desiredPositionDistance(int desiredPos) {
+            // Return distance to desired position (capped at MAX_DISTANCE_R)
+            reading_t current = readPosition();
+            reading_t desired = getPositionReading(desiredPos);
+            reading_t distance = (current > desired) ? current - desired : desired - current;
+            return min(distance, MAX_DISTANCE_R);
         }
 
         int waitForShiftReady() {
             unsigned long waitStart = millis();
             while (shiftReady() != 1)
             {
-                delay(10);  
+                scheduler.wait(10);  
                 if (shiftReady() == -1 || millis() - waitStart > 10*1000){
                     DEBUG_PRINTLN(F("Motor>waitForShiftReady: Shift not ready and needs to abort"));
                     output->setMainMessage(F("Shift not ready and needs to abort"));
-                    delay(1000); 
+                    scheduler.wait(1000); 
                     return -1;  
                 }
             }
@@ -277,55 +264,145 @@ class Motor {
         void tryRecoverBadShift(int previousDesiredPos) {
             if (previousDesiredPos != lastValidPos && isValid(lastValidPos)) {  // If not already trying to return to a previous valid state, do that now
                 output->setMainMessage(F("Shift failed: Attempting to return to last valid state"));
-                delay(2000);
+                recovered = true;
+                shiftLog.enter(PHASE_RETRY);
+                scheduler.wait(2000);
                 attemptShift(lastValidPos, MAX_RETURN_SHIFT_ATTEMPTS);
+                if (abortRequested) {  // Selection changed again, new shift will be started from wherever we are now
+                    return;
+                }
                 if (getPosition() == lastValidPos) {
                     output->setMainMessage(F("Successfully returned to last valid state"));
-                    delay(1000);
+                    scheduler.wait(1000);
                 } else {
                     output->setMainMessage(F("WARNING: Failed to get back to a valid state!"));
-                    delay(5000);
+                    scheduler.wait(5000);
+                }
+            }
+        }
+
+        bool runShift(int desiredPos, int maxAttempts) {
+            // Brake release and the sensor check overlap, and both brake waits end as soon as what they wait for has
+            // been seen (BRAKE_RELEASE_TIME_S is only the longest they can take)
+            shiftLog.enter(PHASE_WAIT_READY);
+            if (waitForShiftReady() < 0) {
+                return false;  // Shift not ready and needs to be aborted
+            }
+
+            singleShiftAttempts = 0;
+            maxControlPeriodUs = 0;
+            targetReading = getPositionReading(desiredPos);
+            targetTolerance = calibration.tolerance(isValid(desiredPos) ? desiredPos : AWD_POS);
+            unsigned long retryWait = 0;
+            setStage(STAGE_RELEASE);
+            while (stage != STAGE_DONE) {
+                scheduler.run();  // Lets the switch be watched (and the shift aborted) within one pass
+                unsigned long elapsed = millis() - stageStart;
+                switch (stage) {
+                    case STAGE_RELEASE: {
+                        unsigned long steady = steadyMs();
+                        if (abortRequested) {
+                            setStage(STAGE_APPLY);
+                        } else if (elapsed >= BRAKE_RELEASE_MIN_MS && steady >= BRAKE_STEADY_MS) {
+                            output->setMainMessage("");
+                            output->setRealtime(true);  // Display only gets what is left of the time budget until STAGE_APPLY
+                            setStage(STAGE_MOVE);
+                        } else if (elapsed >= BRAKE_RELEASE_TIME_S*1000UL) {
+                            output->setMainMessage(F("Mode sensor out of range or unsteady: not shifting"));
+                            setStage(STAGE_APPLY);
+                        }
+                        break;
+                    }
+
+                    case STAGE_MOVE: {
+                        markControlTick();
+                        readPosition();  // Keeps the displayed voltage current (the interrupt reads adcSampler directly)
+                        if (motorControl.hasArrived()) {
+                            setStage(STAGE_APPLY);
+                            break;
+                        }
+                        if (abortRequested) {
+                            DEBUG_PRINTLN(F("Motor>runShift: Aborted"));
+                            setStage(STAGE_APPLY);
+                            break;
+                        }
+                        DEBUG_PRINT(F("Motor>runShift: desiredPositionDistance = "));DEBUG_PRINTLN(desiredPositionDistance(desiredPos));
+                        bool stalled = motorControl.hasStalled();
+                        if (!stalled && checkShiftTimeout() > 0) {
+                            break;
+                        }
+                        // Failed to shift (motor not moving, or by timeout)
+                        DEBUG_PRINTLN(stalled ? F("Motor>runShift: Stalled") : F("Motor>runShift: Timed out"));
+                        stopMotor();
+                        if (getPosition() == desiredPos) {
+                            output->setMainMessage(F("Didn't reach target V, but in desired Position"));
+                            setStage(STAGE_APPLY);
+                        } else if (singleShiftAttempts < maxAttempts-1) {
+                            output->setMainMessage(F("Shift attempt failed. Will retry"));
+                            addShiftAttempt();
+                            stallCount += stalled;
+                            retryWait = retryWaitMs(stalled);
+                            setStage(STAGE_RETRY);
+                        } else {
+                            tryRecoverBadShift(desiredPos);  // (Runs a whole shift of its own, so stage is set again after)
+                            setStage(STAGE_APPLY);
+                        }
+                        break;
+                    }
+
+                    case STAGE_RETRY:
+                        if (abortRequested) {
+                            setStage(STAGE_APPLY);
+                        } else if (elapsed >= retryWait) {
+                            output->setMainMessage(F("Retrying"));
+                            setStage(STAGE_MOVE);
+                        }
+                        break;
+
+                    case STAGE_APPLY: {
+                        // Not cancellable, brake has to go back on
+                        unsigned long steady = steadyMs();
+                        if ((elapsed >= BRAKE_APPLY_MIN_MS && steady >= BRAKE_STEADY_MS) || elapsed >= BRAKE_RELEASE_TIME_S*1000UL) {
+                            setStage(STAGE_DONE);
+                        }
+                        break;
+                    }
+
+                    case STAGE_DONE:
+                        break;
                 }
+                halWaitForInterrupt();  // Every stage waits on something an interrupt changes (time, samples, the control tick)
             }
+            return getPosition() == desiredPos;
         }
 
     public:
         // Motor(uint8_t pwmPin, uint8_t dirPin, uint8_t brakeReleasePin, uint8_t modePin, uint8_t vOutPin,OtherOutputs* out)
-        Motor(uint8_t pwmPin, uint8_t dirPin, uint8_t brakeReleasePin, uint8_t modePin, OtherOutputs* out)
-            : dirPin(dirPin)
-            , pwmPin(pwmPin)
-            , brakeReleasePin(brakeReleasePin)
-            , modePin(modePin)
+        Motor(uint8_t modePin, OtherOutputs* out)
+            : modePin(modePin)
             , output(out)
         {
         }
 
         void begin() {
-            pinMode(dirPin, OUTPUT);
-            pinMode(pwmPin, OUTPUT);
-            pinMode(brakeReleasePin, OUTPUT);
+            FastPin<BRAKE_RELEASE_PIN>::output();  // Direction and PWM pins are set up by motorPwm
             pinMode(modePin, INPUT);
+            motorControl.begin(modePin);
 
             lastValidPos = readEEPROMposition();
+            shiftHistory.begin();
+            calibration.begin();
+            feedForward.begin();
             currentPos = getPosition();
         }
 
         int getPosition() {
             // Check current position, returns -1 or -2 for bad positions
-            float currentPosVolts = readPositionVolts();
+            reading_t reading = readPosition();
             int position;
-            if (currentPosVolts < LOW_LIMIT || currentPosVolts > HIGH_LIMIT) {
-                position = -2;  // Bad position and out of range
-            } else if (currentPosVolts > LOCK_V - MOTOR_DRIFT_TOLERANCE_V && currentPosVolts < LOCK_V + MOTOR_DRIFT_TOLERANCE_V) {
-                position = FOURHI;
-            } else if (currentPosVolts > AWD_V - MOTOR_DRIFT_TOLERANCE_V && currentPosVolts < AWD_V + MOTOR_DRIFT_TOLERANCE_V) {
-                position = AWD;
-            } else if (currentPosVolts > N_V - MOTOR_DRIFT_TOLERANCE_V && currentPosVolts < N_V + MOTOR_DRIFT_TOLERANCE_V) {
-                position = NEUTRAL;
-            } else if (currentPosVolts > LO_V - MOTOR_DRIFT_TOLERANCE_V && currentPosVolts < LO_V + MOTOR_DRIFT_TOLERANCE_V) {
-                position = FOURLO;
-            } else {
-                position = -1; // Bad position but in range
+            {
+                PROFILE_SCOPE(PROF_CLASSIFY);
+                position = calibration.classify(reading);  // Table built from specifications.h (see sensors.h) until calibrated
             }
 
             if (isValid(position)) {
@@ -347,44 +424,116 @@ class Motor {
         }
 
         bool attemptShift(int desiredPos, int maxAttempts) {
-            if (waitForShiftReady() < 0) {
-                return -1;  // Shift not ready and needs to be aborted
+            bool outermost = !shifting;  // tryRecoverBadShift calls this again from inside a shift
+            unsigned long retriesBefore = retryCount;
+            int fromPos = lastValidPos;
+            unsigned long startTime = millis();
+            if (outermost) {
+                shifting = true;
+                abortRequested = false;
+                recovered = false;
+                stallCount = 0;
+                requestedPos = desiredPos;
+                shiftLog.begin(fromPos, desiredPos);
+                shiftHistory.start(fromPos, desiredPos);
+                telemetry.event(EVENT_SHIFT_START, fromPos, desiredPos, 0);
+            }
+            bool success = runShift(desiredPos, maxAttempts);
+            if (outermost) {
+                shifting = false;
+                feedForward.endShift(stallCount > 0);
+                uint8_t flags = (success ? SHIFT_SUCCESS : 0) | (recovered ? SHIFT_RECOVERED : 0) | (abortRequested ? SHIFT_ABORTED : 0)
+                    | (feedForward.isWeak() ? SHIFT_MOTOR_WEAK : 0);
+                uint8_t retries = min(retryCount - retriesBefore, 255UL);
+                shiftLog.end(retries, flags);
+                shiftHistory.end(fromPos, desiredPos, millis() - startTime, retries, stallCount, flags, readPosition());
+                telemetry.event(EVENT_SHIFT_END, fromPos, desiredPos, flags);
             }
+            return success;
+        }
 
-            initializeShift();
-            DEBUG_PRINT(F("Motor>attemptShift: desiredPositionDistance() = ")); DEBUG_PRINTLN(desiredPositionDistance(desiredPos));
-            while (desiredPositionDistance(desiredPos) > POSITION_TOLERANCE) {
-                DEBUG_PRINT(F("Motor>attemptShift: desiredPositionDistance = "));DEBUG_PRINTLN((double)desiredPositionDistance(desiredPos));
-                if (checkShiftTimeout() > 0) { 
-                    stepShiftSpeed(desiredPositionDirection(desiredPos), desiredPos);
-                } else {  // Failed to shift by timeout
-                    stopMotor();
-                    if (getPosition() == desiredPos) {
-                        output->setMainMessage(F("Didn't reach target V, but in desired Position"));
-                        delay(2000);
-                        break;
-                    }  
-                    else if (singleShiftAttempts < MAX_SINGLE_SHIFT_ATTEMPTS-1) {
-                        output->setMainMessage(F("Shift attempt failed. Will retry"));
-                        addShiftAttempt();
-                        delay(RETRY_TIME_S*1000);
-                        output->setMainMessage(F("Retrying"));
-                        shiftStart = millis();
-                        continue;
-                    } else {
-                        tryRecoverBadShift(desiredPos);
-                        break;
+        bool calibrate() {
+            // Visit every position from 4LO across to 4HI, let the shaft settle into the detent (STAGE_APPLY waits for
+            // it with the brake off) and sample the mode sensor with the brake on. Shifts go to the current targets,
+            // so an already calibrated unit starts from its learned positions.
+            // Returns false, keeping what was there before, if a position can't be reached or the results don't pass
+            // SensorCalibration::check()
+            const uint8_t order[4] = {LO_POS, N_POS, AWD_POS, LOCK_POS};
+            CalibrationData learned;
+            abortRequested = false;  // (The selector isn't watched, shifting stays false)
+            for (uint8_t i = 0; i < 4; i++) {
+                uint8_t position = order[i];
+                output->setMainMessage(F("Calibrating"));
+                recovered = false;
+                runShift(position, MAX_SINGLE_SHIFT_ATTEMPTS);
+                if (recovered || !motorControl.hasArrived()) {
+                    output->setMainMessage(F("Calibration failed: couldn't reach position"));
+                    return false;
+                }
+                uint32_t sum = 0;
+                uint16_t lowest = 1023;
+                uint16_t highest = 0;
+                for (uint8_t n = 0; n < CALIBRATION_SAMPLES; n++) {
+                    scheduler.wait(CALIBRATION_SAMPLE_MS);
+                    uint16_t count;
+                    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                        count = adcSampler.getLatest(modePin);
                     }
+                    sum += count;
+                    lowest = min(lowest, count);
+                    highest = max(highest, count);
                 }
+                learned.plateau[position] = (sum << READING_SHIFT) / CALIBRATION_SAMPLES;
+                learned.noise[position] = min(highest - lowest, 255);
             }
-            return endShift(desiredPos);
+            bool saved = calibration.set(learned);
+            output->setMainMessage(saved ? F("Calibration saved") : F("Calibration failed: positions out of range"));
+            getPosition();  // Re-classify with the new windows
+            return saved;
+        }
+
+        bool isShifting() {
+            return shifting;
+        }
+
+        int getRequestedPos() {
+            return requestedPos;
+        }
+
+        void requestAbort() {
+            // Safe to call from a scheduler task, the shift stops at its next tick and returns false
+            abortRequested = true;
+        }
+
+        reading_t position() {
+            // Filtered mode sensor reading from the estimator (see estimator.h)
+            return motorControl.estimatedPosition();
+        }
+
+        int32_t velocity() {
+            // Estimated mode sensor readings per second (+ve is increasing voltage)
+            return motorControl.estimatedVelocity();
+        }
+
+        unsigned long getRetryCount() {
+            return retryCount;
+        }
+
+        unsigned long getMaxControlPeriodUs() {
+            // Worst time between shift loop iterations during the last shift (includes any rendering that was allowed)
+            return maxControlPeriodUs;
+        }
+
+        bool shiftAborted() {
+            // Whether the last shift ended because requestAbort() was called
+            return abortRequested;
         }
 
         void manualDrive(int direction) {
             if (brakeState == ON) {
                 setBrake(OFF);
             }
-            stepShiftSpeed(direction, MANUAL_POS);
+            motorControl.drive(direction);
         }
 
         void manualStop() {
@@ -400,11 +549,11 @@ class Motor {
 
         void testMotorForward(int ms) {
             output->setMainMessage(F("Testing toward 4LO"));
-            motorDirection = TOWARD_4LO;
-            motorSpeed = 0.1;
             setBrake(OFF);
             delay(500);
-            setMotor();
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                motorControl.setOutput(TOWARD_4LO, speedFraction(0.1));
+            }
             delay(ms);
             stopMotor();
             delay(500);
@@ -414,11 +563,11 @@ class Motor {
 
         void testMotorBackward(int ms) {
             output->setMainMessage(F("Testing toward 4HI"));
-            motorDirection = TOWARD_4HI;
-            motorSpeed = 0.1;
             setBrake(OFF);
             delay(500);
-            setMotor();
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                motorControl.setOutput(TOWARD_4HI, speedFraction(0.1));
+            }
             delay(ms);
             stopMotor();
             delay(500);
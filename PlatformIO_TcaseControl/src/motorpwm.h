@@ -0,0 +1,116 @@
+#pragma once
+#include <Arduino.h>
+#include "hal.h"
+#include "specifications.h"
+#include "fastpin.h"
+
+// Motor PWM driver
+// MOTOR_PWM_PIN is a Timer1 output and the driver owns Timer1, with ICR1 as TOP: the frequency is
+// MOTOR_PWM_FREQUENCY_HZ (the prescaler is the smallest that fits the period in 16 bits, worked out at compile time)
+// in phase correct or fast PWM mode (MOTOR_PWM_PHASE_CORRECT), with MOTOR_PWM_TOP counts per period.
+// - Duty is in integer units of 1/2^MOTOR_DUTY_FRACTION_BITS of a PWM_MAX_POWER count (MOTOR_DUTY_FULL = always on),
+//   scaled to Timer1 counts as it's written. The period must have at least that many counts (checked below), so
+//   every unit is a real change in pulse width.
+// - set() only changes the target. The Timer1 overflow interrupt (once per period) steps toward it over
+//   MOTOR_PWM_RAMP_PERIODS periods, about one control tick, so the duty changes a little every period rather than all
+//   at once every tick. OCR1A/B are double buffered, so what the interrupt writes is used from the next period.
+// Stopping and direction changes take effect straight away (the PWM pin is low before the direction pin changes).
+
+const uint16_t MOTOR_DUTY_FULL = 255U << MOTOR_DUTY_FRACTION_BITS;
+constexpr uint16_t MOTOR_PWM_PRESCALERS[5] = {1, 8, 64, 256, 1024};  // Timer1 clock select 1 -> 5
+
+constexpr uint32_t motorPwmCounts(uint16_t prescaler) {
+    // Timer1 counts per period (phase correct counts up to TOP and back down, so it's half as many)
+    return F_CPU / ((uint32_t)prescaler * MOTOR_PWM_FREQUENCY_HZ * (MOTOR_PWM_PHASE_CORRECT ? 2 : 1));
+}
+
+constexpr uint8_t motorPwmClockSelect(uint8_t cs = 1) {
+    return (cs == 5 || motorPwmCounts(MOTOR_PWM_PRESCALERS[cs - 1]) <= 65535) ? cs : motorPwmClockSelect(cs + 1);
+}
+
+constexpr uint8_t MOTOR_PWM_CLOCK_SELECT = motorPwmClockSelect();
+constexpr uint32_t MOTOR_PWM_COUNTS = motorPwmCounts(MOTOR_PWM_PRESCALERS[MOTOR_PWM_CLOCK_SELECT - 1]);
+constexpr uint16_t MOTOR_PWM_TOP = MOTOR_PWM_PHASE_CORRECT ? MOTOR_PWM_COUNTS : MOTOR_PWM_COUNTS - 1;
+constexpr uint32_t MOTOR_PWM_OCR_SCALE = ((uint32_t)MOTOR_PWM_TOP << 16) / MOTOR_DUTY_FULL;  // Duty -> OCR, Q16
+constexpr uint32_t MOTOR_PWM_PERIOD_US = MOTOR_PWM_COUNTS * (MOTOR_PWM_PHASE_CORRECT ? 2 : 1)
+    * MOTOR_PWM_PRESCALERS[MOTOR_PWM_CLOCK_SELECT - 1] / (F_CPU / 1000000UL);
+constexpr uint32_t CONTROL_PERIOD_US = 1000000UL / CONTROL_RATE_HZ;
+constexpr uint8_t MOTOR_PWM_RAMP_PERIODS = (CONTROL_PERIOD_US + MOTOR_PWM_PERIOD_US/2) / MOTOR_PWM_PERIOD_US > 0
+    ? (CONTROL_PERIOD_US + MOTOR_PWM_PERIOD_US/2) / MOTOR_PWM_PERIOD_US : 1;
+static_assert(MOTOR_PWM_PIN == 9 || MOTOR_PWM_PIN == 10, "MOTOR_PWM_PIN has to be a Timer1 output (9 or 10)");
+static_assert(MOTOR_PWM_COUNTS <= 65535, "MOTOR_PWM_FREQUENCY_HZ too low for Timer1");
+static_assert(MOTOR_PWM_TOP >= MOTOR_DUTY_FULL, "MOTOR_PWM_FREQUENCY_HZ too high for MOTOR_DUTY_FRACTION_BITS");
+static_assert(MOTOR_DUTY_FRACTION_BITS <= 6, "MOTOR_DUTY_FRACTION_BITS too big for 16 bit duty");
+
+class MotorPwm {
+    private:
+        uint16_t target = 0;
+        uint16_t duty = 0;  // Ramps toward target
+        int16_t step = 0;  // Per period
+        int8_t direction = 0;
+
+    public:
+        void begin() {
+            FastPin<MOTOR_DIR_PIN>::output();
+            FastPin<MOTOR_PWM_PIN>::output();
+            halMotorPwmBegin(MOTOR_PWM_TOP, MOTOR_PWM_CLOCK_SELECT, MOTOR_PWM_PHASE_CORRECT);
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                set(0, 0);
+            }
+        }
+
+        void set(int8_t dir, uint16_t newDuty) {
+            // With interrupts off (control interrupt, or in an ATOMIC_BLOCK). dir == 0 or newDuty == 0 stops the motor
+            if (dir == 0) {
+                newDuty = 0;
+            }
+            if (newDuty == 0 || dir != direction) {
+                duty = 0;
+                PwmPin<MOTOR_PWM_PIN>::write(0);
+                FastPin<MOTOR_DIR_PIN>::write(dir > 0);
+                direction = dir;
+            }
+            target = min(newDuty, MOTOR_DUTY_FULL);
+            int16_t difference = (int16_t)target - (int16_t)duty;
+            step = difference / MOTOR_PWM_RAMP_PERIODS;
+            if (step == 0 && difference != 0) {
+                step = (difference > 0) ? 1 : -1;
+            }
+        }
+
+        void pause() {
+            // Stop the period interrupt while parked (idle.h). Motor must be stopped
+            halMotorPwmEnable(false);
+        }
+
+        void resume() {
+            halMotorPwmEnable(true);
+        }
+
+        void periodFromISR() {
+            // Timer1 overflow interrupt only
+            if (duty != target) {
+                int16_t next = (int16_t)duty + step;
+                duty = ((step > 0) ? next >= (int16_t)target : next <= (int16_t)target) ? target : next;
+            }
+            if (duty == 0) {
+                return;
+            }
+            PwmPin<MOTOR_PWM_PIN>::write((duty >= MOTOR_DUTY_FULL) ? MOTOR_PWM_TOP : ((uint32_t)duty * MOTOR_PWM_OCR_SCALE) >> 16);
+        }
+
+        uint16_t getDuty() {
+            // Where the ramp has got to (MOTOR_DUTY_FULL = full on)
+            uint16_t now;
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                now = duty;
+            }
+            return now;
+        }
+};
+
+MotorPwm motorPwm;
+
+HAL_MOTOR_PWM_INTERRUPT {
+    motorPwm.periodFromISR();
+}
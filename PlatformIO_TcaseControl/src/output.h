@@ -4,6 +4,9 @@
 #include <LiquidCrystal.h>
 #include <Adafruit_ST7735.h>
 #include "Images.h"
+#include "scheduler.h"
+#include "sensors.h"
+#include "profiler.h"
 
 // #define DEBUG
 
@@ -28,6 +31,19 @@ const int SCREEN_HEIGHT = 240;
 const byte SF = 2;  // Overall Scale Factor for display (i.e. 1 for 128x128px, 2 for 240x240px to make things look similar size)
 const int maxChars = (SCREEN_WIDTH-RIGHT_MARGIN-LEFT_MARGIN)/6/SF;  // Max no. characters per row on screen
 
+const byte DISPLAY_FRAME_RATE_HZ = 15;  // Max rate OtherOutputs::render() redraws at (it is called from a scheduler task)
+
+// Fields of the normal layout, used to mark what needs redrawing
+#define FIELD_MESSAGE 0x01
+#define FIELD_SWITCH_POS 0x02
+#define FIELD_SWITCH_READING 0x04
+#define FIELD_MOTOR_POS 0x08
+#define FIELD_MOTOR_READING 0x10
+#define ALL_FIELDS 0x1F
+#define NUM_FIELDS 5
+
+const unsigned long RENDER_BUDGET_SHIFT_US = 2000;  // Max drawing per render() while a shift is running (real time mode)
+
 const uint16_t PINK = 0xF811;
 const uint16_t BLUE_GREY = 0x3B9C;
 
@@ -92,18 +108,32 @@ class ScreenOut {
         int currentSwitchPos;
         int currentSwitchOhms;
         int currentMotorPos;
-        float currentMotorVolts;
+        long currentMotorReading;
         bool currentMotorPosValid;
+        unsigned long fieldCostUs[NUM_FIELDS];  // Last measured time to draw each field (0 until drawn once)
 
         void resetStored() {
             sprintf(currentMainText, " ");
             currentSwitchPos = 5;
             currentSwitchOhms = 0;
             currentMotorPos = 5;
-            currentMotorVolts = -1.0;
+            currentMotorReading = -(long)READING_FULL_SCALE;
             currentMotorPosValid = true;
         }
 
+        byte fieldIndex(byte field) {
+            byte i = 0;
+            while (field > 1) {
+                field >>= 1;
+                i++;
+            }
+            return i;
+        }
+
+        void recordCost(byte field, unsigned long start) {
+            fieldCostUs[fieldIndex(field)] = micros() - start;
+        }
+
         void writeBlock(const char* text, const byte cursorPosX, const byte cursorPosY, const byte fontSize, const byte width, const byte rows) {
             tft->fillRect(cursorPosX, cursorPosY, width, fontSize*8*rows, bgColor); 
             byte textLen = strlen(text);
@@ -171,6 +201,28 @@ class ScreenOut {
     public:
         // ScreenOut(Adafruit_ST7735 *tft) : tft(tft) {
         ScreenOut(Adafruit_ST7789 *tft) : tft(tft) {
+            for (byte i = 0; i < NUM_FIELDS; i++) {
+                fieldCostUs[i] = 0;
+            }
+        }
+
+        byte fieldsWithinBudget(byte fields, unsigned long budgetUs) {
+            // Subset of fields that can be drawn in budgetUs, based on how long each took last time.
+            // Fields that have never been drawn have an unknown cost and are left out, as is everything if the
+            // normal layout would need redrawing first (that is a full screen fill)
+            if (currentLayout != 1) {
+                return 0;
+            }
+            byte allowed = 0;
+            unsigned long total = 0;
+            for (byte i = 0; i < NUM_FIELDS; i++) {
+                byte field = 1 << i;
+                if ((fields & field) && fieldCostUs[i] > 0 && total + fieldCostUs[i] <= budgetUs) {
+                    total += fieldCostUs[i];
+                    allowed |= field;
+                }
+            }
+            return allowed;
         }
 
 
@@ -184,23 +236,31 @@ class ScreenOut {
             drawCat();
         }
 
-        void writeNormalValues(const char* mainText, const int switchPos, const int switchOhms, const int motorPos, const float motorVolts, bool motorPosValid) {
+        void writeNormalValues(const char* mainText, const int switchPos, const reading_t switchReading, const int motorPos, const reading_t motorReading, bool motorPosValid, byte fields = ALL_FIELDS) {
+            // Only the fields flagged in fields are checked against what is currently on screen.
+            // Readings are only converted to ohms/volts here, when they might actually be drawn
+            PROFILE_SCOPE(PROF_RENDER);
             char buffer[maxChars+1];
 
             // Fill normal layout with values
             if (currentLayout != 1) {
                 initNormalLayout();
                 resetStored();
+                fields = ALL_FIELDS;
             }
 
-            if (switchPos != currentSwitchPos) {
+            unsigned long start;
+            if ((fields & FIELD_SWITCH_POS) && switchPos != currentSwitchPos) {
+                start = micros();
                 DEBUG_PRINT(F("ScreenOut>WriteNormalValues: switchPos = ")); DEBUG_PRINT(switchPos); DEBUG_PRINTLN("");
                 posToStr(buffer, switchPos);
                 writeBlock(buffer, LEFT_MARGIN+4*SF, 25*SF+TOP_MARGIN, 2*SF, SCREEN_WIDTH/2-8*SF-LEFT_MARGIN, 1);
                 currentSwitchPos = switchPos;
+                recordCost(FIELD_SWITCH_POS, start);
             }
 
-            if (motorPos != currentMotorPos || motorPosValid != currentMotorPosValid) {
+            if ((fields & FIELD_MOTOR_POS) && (motorPos != currentMotorPos || motorPosValid != currentMotorPosValid)) {
+                start = micros();
                 posToStr(buffer, motorPos);
                 writeBlock(buffer, SCREEN_WIDTH/2+4*SF, 25*SF+TOP_MARGIN, 2*SF, SCREEN_WIDTH/2-8*SF-RIGHT_MARGIN, 1);
                 if (!motorPosValid) {
@@ -208,27 +268,33 @@ class ScreenOut {
                 }
                 currentMotorPos = motorPos;
                 currentMotorPosValid = motorPosValid;
+                recordCost(FIELD_MOTOR_POS, start);
             }
 
-            if (abs((float)switchOhms/currentSwitchOhms - 1.0) > 0.015) {  // If changes by more than X%
+            int switchOhms = (fields & FIELD_SWITCH_READING) ? readingToOhms(switchReading) : currentSwitchOhms;
+            if (labs((long)switchOhms - currentSwitchOhms)*1000 > 15L*currentSwitchOhms) {  // If changes by more than 1.5%
+                start = micros();
                 sprintf(buffer, "%d \351", switchOhms);
                 writeBlock(buffer, LEFT_MARGIN+4*SF, TOP_MARGIN+50*SF, 1*SF, SCREEN_WIDTH/2-8*SF - LEFT_MARGIN, 1);
                 currentSwitchOhms = switchOhms;
+                recordCost(FIELD_SWITCH_READING, start);
             }
 
-            if (abs(motorVolts - currentMotorVolts) > 0.02) {
-                if (motorVolts < 10 && motorVolts > -10) {
-                    char temp[7];
-                    dtostrf(motorVolts, 4, 3, temp);
-                    sprintf(buffer, "%s V", temp);
-                    writeBlock(buffer, SCREEN_WIDTH/2+4*SF, 50*SF+TOP_MARGIN, 1*SF, SCREEN_WIDTH/2-8*SF - RIGHT_MARGIN, 1);
-                    currentMotorVolts = motorVolts;
-                }
+            if ((fields & FIELD_MOTOR_READING) && labs((long)motorReading - currentMotorReading) > voltsToReadingFloor(0.02)) {
+                start = micros();
+                char temp[7];
+                dtostrf(readingToVolts(motorReading), 4, 3, temp);
+                sprintf(buffer, "%s V", temp);
+                writeBlock(buffer, SCREEN_WIDTH/2+4*SF, 50*SF+TOP_MARGIN, 1*SF, SCREEN_WIDTH/2-8*SF - RIGHT_MARGIN, 1);
+                currentMotorReading = motorReading;
+                recordCost(FIELD_MOTOR_READING, start);
             }
 
-            if (strcmp(mainText, currentMainText) != 0) {
+            if ((fields & FIELD_MESSAGE) && strcmp(mainText, currentMainText) != 0) {
+                start = micros();
                 writeBlock(mainText, LEFT_MARGIN+4*SF, 75*SF+TOP_MARGIN, 1*SF, SCREEN_WIDTH-8*SF-LEFT_MARGIN-RIGHT_MARGIN, 4);
                 snprintf(currentMainText, maxChars*4, mainText);
+                recordCost(FIELD_MESSAGE, start);
             }
 
         }
@@ -244,11 +310,17 @@ class OtherOutputs {
     private: 
         char mainMessage[maxChars*4+1];  // Main message text (sized to fit 32 characters plus \0 termination)
         int switchPos = -1; 
-        int switchResistance = -1;
+        reading_t switchReading = 0;
         int motorPos = -1;
         bool motorPosValid = true;
-        float motorVolts = -1;
+        reading_t motorReading = 0;
         int displayMode = 0;  // So screen can display different information based on selected mode
+        byte dirtyFields = 0;  // Fields changed since the last render
+        bool begun = false;
+        bool paused = false;  // Something else (e.g. the cat) is on the screen
+        unsigned long pausedAt = 0;
+        unsigned int pauseMs = 0;  // render() takes the screen back after this long
+        bool realtime = false;  // A shift is running, drawing is limited to RENDER_BUDGET_SHIFT_US per render()
         // byte fakeSwitchState = AWD;
         // byte fakeMotorState = AWD;
         // char motorMessage[33]; // Message from Motor
@@ -256,11 +328,15 @@ class OtherOutputs {
         // uint8_t fakeSwitchPin;
         // uint8_t fakeMotorPin;
 
-        void writeDisplay() {
+        void writeDisplay(byte fields) {
             // screenOut.writeScreen(mainMessage, switchPos, motorPos);
-            screenOut.writeNormalValues(mainMessage, switchPos, switchResistance, motorPos, motorVolts, motorPosValid);
+            screenOut.writeNormalValues(mainMessage, switchPos, switchReading, motorPos, motorReading, motorPosValid, fields);
         }        
 
+        void markDirty(byte fields) {
+            dirtyFields |= fields;
+        }
+
         void writeFakePinOuts() {
             // Set pin outs to trick the Car into thinking it's in a certain state
             // if (isValid(switchPos)) {
@@ -293,6 +369,7 @@ class OtherOutputs {
 
         void begin() {
             screenOut.begin();
+            begun = true;
             // TODO: Set pin outs for whatever I end up using to trick car
             // pinMode(fakeSwitchPin, OUTPUT);
             // pinMode(fakeMotorPin, OUTPUT);
@@ -302,20 +379,50 @@ class OtherOutputs {
 
         void writeOutputs() {
             // Output signals to trick car into thinking it's in correct state
-            // And display screen
+            // And display screen (immediately, regardless of frame rate. Normally render() does this)
             // writeFakePinOuts();
-            writeDisplay();
+            if (begun) {
+                writeDisplay(ALL_FIELDS);
+                dirtyFields = 0;
+            }
+        }
+
+        void render() {
+            // Redraw whatever changed since the last call. The setters below only update values and mark them dirty,
+            // so however many times they are called, the screen is drawn at most once per call here.
+            // Called from a scheduler task at DISPLAY_FRAME_RATE_HZ
+            if (paused && millis() - pausedAt >= pauseMs) {
+                paused = false;
+                writeOutputs();
+            }
+            if (!begun || paused || dirtyFields == 0) {
+                return;
+            }
+            byte fields = dirtyFields;
+            if (realtime) {
+                fields = screenOut.fieldsWithinBudget(fields, RENDER_BUDGET_SHIFT_US);  // The rest wait until the shift is done
+                if (fields == 0) {
+                    return;
+                }
+            }
+            dirtyFields &= ~fields;  // Cleared first, so anything set while drawing is picked up next time
+            writeDisplay(fields);
+        }
+
+        void setRealtime(bool on) {
+            // While on, the motor control loop has priority: render() only draws fields that fit in the time budget
+            realtime = on;
         }
 
         void setMainMessage (const char *message) {
             copystr(mainMessage, message, maxChars*4);
-            writeOutputs();
+            markDirty(FIELD_MESSAGE);
         }
 
         void setMainMessage (const __FlashStringHelper *message) {
             // const char *buffer = (const char PROGMEM *)message;
             copystr(mainMessage, message, maxChars*4);
-            writeOutputs();
+            markDirty(FIELD_MESSAGE);
         }
         
         void getMainMessage(char* str, int strlen) {
@@ -323,31 +430,34 @@ class OtherOutputs {
         }
 
         void setSwitchPos(int pos) {
-            if (0 <= pos && pos <= 3) {
+            if (0 <= pos && pos <= 3 && pos != switchPos) {
                 switchPos = pos;
+                markDirty(FIELD_SWITCH_POS);
             }
-            writeOutputs();
         }
 
-        void setSwitchResistance(int resistance) {
-            switchResistance = resistance;
-            writeOutputs();
+        void setSwitchReading(reading_t reading) {
+            if (reading != switchReading) {
+                switchReading = reading;
+                markDirty(FIELD_SWITCH_READING);
+            }
         }
 
         void setMotorPos(int pos, int lastValid) {
-            if (0 <= pos && pos <= 3) {
-                motorPos = pos;
-                motorPosValid = true;
-            } else {
-                motorPos = lastValid;
-                motorPosValid = false;
+            bool valid = (0 <= pos && pos <= 3);
+            int newPos = valid ? pos : lastValid;
+            if (newPos != motorPos || valid != motorPosValid) {
+                motorPos = newPos;
+                motorPosValid = valid;
+                markDirty(FIELD_MOTOR_POS);
             }
-            writeOutputs();
         }
         
-        void setMotorVolts(float volts) {
-            motorVolts = volts;
-            writeOutputs();
+        void setMotorReading(reading_t reading) {
+            if (reading != motorReading) {
+                motorReading = reading;
+                markDirty(FIELD_MOTOR_READING);
+            }
         }
 
         // void setMotorMessage(const char *message) {
@@ -360,9 +470,11 @@ class OtherOutputs {
         //     writeOutputs();
         // }
 
-        void showCat(int delay_ms) {
+        void showCat(unsigned int delay_ms) {
+            // Returns straight away, render() puts everything back after delay_ms
             screenOut.showCat();
-            delay(delay_ms);
-            writeOutputs();
+            paused = true;  // Stop render() drawing over it
+            pausedAt = millis();
+            pauseMs = delay_ms;
         }
 };
\ No newline at end of file
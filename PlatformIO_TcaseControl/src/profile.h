@@ -0,0 +1,95 @@
+#pragma once
+#include <stdint.h>
+#include "specifications.h"
+#include "sensors.h"
+
+// Speed profiles for shifts
+// Speeds are Q15 fixed point (SPEED_ONE == PWM_MAX_POWER) because they are calculated in the control interrupt.
+// nextSpeed() is called once per control tick with the remaining distance to the target and returns the new speed.
+
+const uint16_t SPEED_ONE = 32768;
+
+constexpr uint16_t speedFraction(float fraction) {
+    return fraction * SPEED_ONE;
+}
+
+constexpr uint16_t accelPerTick(float accel) {
+    return accel * SPEED_ONE / CONTROL_RATE_HZ;
+}
+
+uint16_t isqrt32(uint32_t n) {
+    // Integer square root (floor), bit by bit so no division
+    uint32_t root = 0;
+    uint32_t bit = 1UL << 30;
+    while (bit > n) {
+        bit >>= 2;
+    }
+    while (bit != 0) {
+        if (n >= root + bit) {
+            n -= root + bit;
+            root = (root >> 1) + bit;
+        } else {
+            root >>= 1;
+        }
+        bit >>= 2;
+    }
+    return root;
+}
+
+struct ProfileLimits {
+    uint16_t accelPerTick;  // Speed increase per control tick
+    reading_t stopDistance;  // Distance needed to slow down from SPEED_ONE
+};
+
+constexpr ProfileLimits PROFILE_LIMITS_TOWARD_4HI = {accelPerTick(PROFILE_ACCEL_TOWARD_4HI), voltsToReadingFloor(PROFILE_STOP_DISTANCE_TOWARD_4HI_V)};
+constexpr ProfileLimits PROFILE_LIMITS_TOWARD_4LO = {accelPerTick(PROFILE_ACCEL_TOWARD_4LO), voltsToReadingFloor(PROFILE_STOP_DISTANCE_TOWARD_4LO_V)};
+const reading_t PROFILE_AIM_OFFSET = voltsToReadingFloor(POSITION_TOLERANCE)/2;  // Plan to stop this far short of the target (middle of tolerance)
+
+class MotionProfile {
+    private:
+        byte type = MOTION_PROFILE;
+
+        uint16_t stepLimit(reading_t distance) {
+            // Original speed table
+            if (distance > voltsToReadingFloor(0.5)) {
+                return speedFraction(1.0);
+            } else if (distance > voltsToReadingFloor(0.4)) {
+                return speedFraction(0.5);
+            } else if (distance > voltsToReadingFloor(0.3)) {
+                return speedFraction(0.3);
+            } else if (distance > voltsToReadingFloor(0.1)) {
+                return speedFraction(0.1);
+            }
+            return speedFraction(0.01);  // I.e. min speed
+        }
+
+        uint16_t decelLimit(reading_t distance, const ProfileLimits &limits) {
+            // Constant deceleration: speed = SPEED_ONE*sqrt(distance/stopDistance)
+            if (distance <= PROFILE_AIM_OFFSET) {
+                return 1;  // Still inside tolerance band is checked by the caller, keep creeping at minimum power
+            }
+            uint32_t d = distance - PROFILE_AIM_OFFSET;
+            if (d >= limits.stopDistance) {
+                return SPEED_ONE;
+            }
+            return isqrt32(d * ((1UL << 30) / limits.stopDistance));  // (SPEED_ONE^2/stopDistance)*d <= 2^30
+        }
+
+    public:
+        void setType(byte profileType) {
+            type = profileType;
+        }
+
+        byte getType() {
+            return type;
+        }
+
+        uint16_t nextSpeed(uint16_t speed, reading_t distance, int8_t direction) {
+            // distance is what is left to the target (less any look ahead, so can be 0)
+            if (type == PROFILE_STEPS) {
+                return min((uint16_t)(speed + accelPerTick(PWM_ACCELERATION)), stepLimit(distance));
+            }
+            const ProfileLimits &limits = (direction == TOWARD_4LO) ? PROFILE_LIMITS_TOWARD_4LO : PROFILE_LIMITS_TOWARD_4HI;
+            return min((uint16_t)(speed + limits.accelPerTick), decelLimit(distance, limits));
+        }
+};
@@ -0,0 +1,119 @@
+#pragma once
+#include <Arduino.h>
+
+// Optional timing profiler
+// Build with -DPROFILE (e.g. pio run -e uno_profile) to record how long named scopes take: count, min/max/mean and a
+// log2 histogram (bucket 0 is < 1us, bucket n is 2^(n-1) -> 2^n - 1us, the last bucket is everything longer).
+// Without PROFILE the macros are empty so there is no cost at all.
+//   PROFILE_SCOPE(PROF_xxx)  times from here to the end of the enclosing block
+//   PROFILE_PRINT()          prints every scope as CSV over Serial ('p' command in main.cpp)
+//   PROFILE_RESET()
+// Times come from micros() so have 4us resolution on the board.
+
+enum ProfileScopeId : uint8_t {
+    PROF_LOOP,  // One loop() iteration (includes a whole shift when one happens)
+    PROF_ADC_READ,  // Getting an averaged reading from adcSampler
+    PROF_CLASSIFY,  // Reading -> position
+    PROF_RENDER,  // ScreenOut::writeNormalValues
+    PROF_EEPROM_WRITE,
+    NUM_PROFILE_SCOPES
+};
+
+#ifdef PROFILE
+
+const char PROFILE_SCOPE_NAMES[NUM_PROFILE_SCOPES][13] PROGMEM = {"loop", "adc_read", "classify", "render", "eeprom_write"};
+const byte PROFILE_BUCKETS = 20;  // Last bucket is >= 2^18us (~0.26s)
+
+struct ProfileStats {
+    uint32_t count;
+    uint32_t totalUs;
+    uint32_t minUs;
+    uint32_t maxUs;
+    uint16_t histogram[PROFILE_BUCKETS];
+};
+
+class Profiler {
+    private:
+        ProfileStats stats[NUM_PROFILE_SCOPES];
+
+        byte bucketFor(uint32_t us) {
+            byte bucket = 0;
+            while (us > 0 && bucket < PROFILE_BUCKETS - 1) {
+                us >>= 1;
+                bucket++;
+            }
+            return bucket;
+        }
+
+    public:
+        Profiler() {
+            reset();
+        }
+
+        void reset() {
+            memset(stats, 0, sizeof(stats));
+            for (byte i = 0; i < NUM_PROFILE_SCOPES; i++) {
+                stats[i].minUs = 0xFFFFFFFF;
+            }
+        }
+
+        void record(byte id, uint32_t us) {
+            ProfileStats &s = stats[id];
+            s.count++;
+            s.totalUs += us;
+            s.minUs = min(s.minUs, us);
+            s.maxUs = max(s.maxUs, us);
+            uint16_t &bucket = s.histogram[bucketFor(us)];
+            if (bucket < 0xFFFF) {
+                bucket++;
+            }
+        }
+
+        void print() {
+            Serial.println(F("scope,count,min_us,mean_us,max_us,histogram (log2 us buckets)"));
+            for (byte i = 0; i < NUM_PROFILE_SCOPES; i++) {
+                ProfileStats &s = stats[i];
+                char name[13];
+                strcpy_P(name, PROFILE_SCOPE_NAMES[i]);
+                Serial.print(name); Serial.print(',');
+                Serial.print(s.count); Serial.print(',');
+                Serial.print(s.count ? s.minUs : 0); Serial.print(',');
+                Serial.print(s.count ? s.totalUs / s.count : 0); Serial.print(',');
+                Serial.print(s.maxUs);
+                for (byte b = 0; b < PROFILE_BUCKETS; b++) {
+                    Serial.print(b ? ' ' : ',');
+                    Serial.print(s.histogram[b]);
+                }
+                Serial.println();
+            }
+        }
+};
+
+Profiler profiler;
+
+class ProfileScope {
+    private:
+        byte id;
+        unsigned long start;
+
+    public:
+        ProfileScope(byte scopeId) : id(scopeId), start(micros()) {}
+
+        ~ProfileScope() {
+            profiler.record(id, micros() - start);
+        }
+};
+
+#define PROFILE_JOIN2(a, b) a##b
+#define PROFILE_JOIN(a, b) PROFILE_JOIN2(a, b)
+#define PROFILE_SCOPE(id) ProfileScope PROFILE_JOIN(profileScope, __LINE__)(id)
+#define PROFILE_PRINT() profiler.print()
+#define PROFILE_RESET() profiler.reset()
+
+#else
+
+#define PROFILE_SCOPE(id)
+#define PROFILE_PRINT()
+#define PROFILE_RESET()
+
+#endif
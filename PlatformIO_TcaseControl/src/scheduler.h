@@ -0,0 +1,107 @@
+#pragma once
+#include <Arduino.h>
+#include "hal.h"
+
+// Small cooperative scheduler. Tasks are plain functions that must return quickly (no delay() inside).
+// Periodic tasks are re-armed from their deadline (not from when they actually ran) so the rate doesn't drift,
+// one-shot tasks free their slot after running once.
+// Anything that used to delay() should call scheduler.wait() instead so that other tasks keep running.
+
+const byte MAX_TASKS = 8;
+
+typedef void (*TaskCallback)();
+
+struct Task {
+    TaskCallback callback;
+    unsigned long period;    // ms between runs (0 for one-shot)
+    unsigned long deadline;  // millis() at which task is next due
+    bool active;
+    bool running;            // Prevents a task from being re-entered by a wait() inside something it called
+};
+
+class Scheduler {
+    private:
+        Task tasks[MAX_TASKS];
+        unsigned long maxLate = 0;  // Worst time (ms) a task has run after its deadline
+
+        int addTask(TaskCallback callback, unsigned long period, unsigned long delay_ms) {
+            for (byte i = 0; i < MAX_TASKS; i++) {
+                if (!tasks[i].active) {
+                    tasks[i].callback = callback;
+                    tasks[i].period = period;
+                    tasks[i].deadline = millis() + delay_ms;
+                    tasks[i].running = false;
+                    tasks[i].active = true;
+                    return i;
+                }
+            }
+            return -1;  // No free slots (increase MAX_TASKS)
+        }
+
+    public:
+        Scheduler() {
+            for (byte i = 0; i < MAX_TASKS; i++) {
+                tasks[i].active = false;
+                tasks[i].running = false;
+            }
+        }
+
+        int addPeriodic(TaskCallback callback, unsigned long period_ms, unsigned long offset_ms = 0) {
+            // Returns task id (or -1 if no free slot). offset_ms can be used to stagger tasks with the same period
+            return addTask(callback, period_ms, offset_ms);
+        }
+
+        int addOneShot(TaskCallback callback, unsigned long delay_ms) {
+            return addTask(callback, 0, delay_ms);
+        }
+
+        void cancel(int id) {
+            if (id >= 0 && id < MAX_TASKS) {
+                tasks[id].active = false;
+            }
+        }
+
+        void run() {
+            // One scheduler tick: run every task that was due when it started (one due while an earlier one ran waits
+            // for the next tick, which saves a millis() per slot)
+            unsigned long now = millis();
+            for (byte i = 0; i < MAX_TASKS; i++) {
+                Task &task = tasks[i];
+                if (!task.active || task.running || (long)(now - task.deadline) < 0) {
+                    continue;
+                }
+                maxLate = max(maxLate, now - task.deadline);
+                if (task.period > 0) {
+                    task.deadline += task.period;
+                    if ((long)(now - task.deadline) >= 0) {  // Fell more than a whole period behind, don't try to catch up
+                        task.deadline = now + task.period;
+                    }
+                } else {
+                    task.active = false;
+                }
+                task.running = true;
+                task.callback();
+                task.running = false;
+            }
+        }
+
+        bool wait(unsigned long ms, volatile bool *cancel = nullptr) {
+            // Cooperative replacement for delay(). Keeps running tasks while waiting.
+            // Returns false if *cancel became true before the time was up
+            unsigned long start = millis();
+            while (millis() - start < ms) {
+                if (cancel && *cancel) {
+                    return false;
+                }
+                run();
+                halWaitForInterrupt();  // Nothing can become due (or cancel) until an interrupt
+            }
+            return !(cancel && *cancel);
+        }
+
+        unsigned long getMaxLate() {
+            return maxLate;
+        }
+};
+
+Scheduler scheduler;
@@ -0,0 +1,166 @@
+#pragma once
+#include <stdint.h>
+#include "specifications.h"
+
+#ifdef __AVR__
+#include <avr/pgmspace.h>
+#elif !defined(PROGMEM)  // Host builds (tools/)
+#define PROGMEM
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#endif
+
+// Fixed point sensor readings
+// Both analog inputs are handled as a 16 bit "reading": the averaged 10 bit ADC count left aligned by READING_SHIFT
+// bits (i.e. reading = count*64), so an average keeps its fractional part without needing floats.
+// The float constants in specifications.h are turned into reading thresholds at compile time, so classifying a
+// sample is only integer compares. Volts/ohms are only calculated when something needs to display them.
+//
+// Thresholds are calculated exactly from the float constants (not with float arithmetic) so that for every
+// possible reading the classification matches comparing volts/ohms against the constants directly (the old way).
+
+typedef uint16_t reading_t;
+
+const uint8_t READING_SHIFT = 6;
+constexpr uint32_t READING_FULL_SCALE = 1023UL << READING_SHIFT;  // Reading that corresponds to ADC_VIN
+
+// Any float >= 1/8 multiplied by 2^26 is a whole number, which lets the thresholds below be exact
+constexpr uint64_t exactScaled(float value) {
+    return (uint64_t)(value * 67108864.0f);
+}
+
+constexpr reading_t voltsToReadingFloor(float volts) {
+    // Largest reading at or below volts
+    return exactScaled(volts) * READING_FULL_SCALE / exactScaled(ADC_VIN);
+}
+
+constexpr reading_t voltsToReadingCeil(float volts) {
+    // Smallest reading at or above volts
+    return (exactScaled(volts) * READING_FULL_SCALE + exactScaled(ADC_VIN) - 1) / exactScaled(ADC_VIN);
+}
+
+struct ReadingWindow {
+    reading_t low;  // Inclusive
+    reading_t high;  // Inclusive
+};
+
+constexpr bool inWindow(reading_t reading, ReadingWindow window) {
+    return reading >= window.low && reading <= window.high;
+}
+
+constexpr ReadingWindow voltsWindow(float lowVolts, float highVolts) {
+    // Readings for lowVolts < V < highVolts
+    return ReadingWindow{static_cast<reading_t>(voltsToReadingFloor(lowVolts) + 1), static_cast<reading_t>(voltsToReadingCeil(highVolts) - 1)};
+}
+
+// Switch resistance R = R_fixed*(Vin - Vout)/Vout = R_fixed*(FULL_SCALE - reading)/reading (Vin cancels)
+// and the old code rounded R to an int before comparing:
+//   round(R) > ohms  <=>  reading <= 2*R_fixed*FULL_SCALE/(2*ohms + 1 + 2*R_fixed)
+//   round(R) < ohms  <=>  reading >  2*R_fixed*FULL_SCALE/(2*ohms - 1 + 2*R_fixed)
+constexpr reading_t maxReadingAboveOhms(long ohms) {
+    // Largest reading where the rounded resistance is > ohms
+    return 2UL*SWITCH_FIXED_RESISTOR*READING_FULL_SCALE/(2*ohms + 1 + 2L*SWITCH_FIXED_RESISTOR);
+}
+
+constexpr uint32_t minReadingBelowOhms(long ohms) {
+    // Smallest reading where the rounded resistance is < ohms (can be > FULL_SCALE, i.e. never)
+    return 2UL*SWITCH_FIXED_RESISTOR*READING_FULL_SCALE/(2*ohms - 1 + 2L*SWITCH_FIXED_RESISTOR) + 1;
+}
+
+constexpr ReadingWindow ohmsWindow(long lowOhms, long highOhms) {
+    // Readings for lowOhms < round(R) < highOhms (higher resistance -> lower reading)
+    return ReadingWindow{static_cast<reading_t>(minReadingBelowOhms(highOhms)), maxReadingAboveOhms(lowOhms)};
+}
+
+// Mode sensor (indexed by position)
+constexpr ReadingWindow MOTOR_WINDOWS[4] = {
+    voltsWindow(LOCK_V - MOTOR_DRIFT_TOLERANCE_V, LOCK_V + MOTOR_DRIFT_TOLERANCE_V),
+    voltsWindow(AWD_V - MOTOR_DRIFT_TOLERANCE_V, AWD_V + MOTOR_DRIFT_TOLERANCE_V),
+    voltsWindow(N_V - MOTOR_DRIFT_TOLERANCE_V, N_V + MOTOR_DRIFT_TOLERANCE_V),
+    voltsWindow(LO_V - MOTOR_DRIFT_TOLERANCE_V, LO_V + MOTOR_DRIFT_TOLERANCE_V),
+};
+constexpr reading_t MOTOR_LOW_LIMIT_R = voltsToReadingCeil(LOW_LIMIT);  // Anything below is out of range
+constexpr reading_t MOTOR_HIGH_LIMIT_R = voltsToReadingFloor(HIGH_LIMIT);  // Anything above is out of range
+
+// Selector switch (indexed by position)
+constexpr ReadingWindow SWITCH_WINDOWS[4] = {
+    ohmsWindow(SW_LOCK_LOW, SW_LOCK_HIGH),
+    ohmsWindow(SW_AWD_LOW, SW_AWD_HIGH),
+    ohmsWindow(SW_N_LOW, SW_N_HIGH),
+    ohmsWindow(SW_LO_LOW, SW_LO_HIGH),
+};
+constexpr reading_t SWITCH_OPEN_R = maxReadingAboveOhms(SW_OPEN_LOW);  // Anything at or below is open circuit
+constexpr uint32_t SWITCH_SHORTED_R = minReadingBelowOhms(SW_SHORTED_HIGH);  // Anything at or above is shorted
+
+constexpr int8_t classifyMotorReading(reading_t reading) {
+    // Returns position 0 -> 3, or -1 if invalid (-2 if invalid and out of range). Same order of checks as the old volts version
+    return (reading < MOTOR_LOW_LIMIT_R || reading > MOTOR_HIGH_LIMIT_R) ? -2
+        : inWindow(reading, MOTOR_WINDOWS[FOURHI]) ? FOURHI
+        : inWindow(reading, MOTOR_WINDOWS[AWD]) ? AWD
+        : inWindow(reading, MOTOR_WINDOWS[NEUTRAL]) ? NEUTRAL
+        : inWindow(reading, MOTOR_WINDOWS[FOURLO]) ? FOURLO
+        : -1;
+}
+
+constexpr int8_t classifySwitchReading(reading_t reading) {
+    // Returns position 0 -> 3, or -1 if invalid (-2 if invalid and out of range). Same order of checks as the old ohms version
+    return (reading <= SWITCH_OPEN_R || reading >= SWITCH_SHORTED_R) ? -2
+        : inWindow(reading, SWITCH_WINDOWS[FOURHI]) ? FOURHI
+        : inWindow(reading, SWITCH_WINDOWS[AWD]) ? AWD
+        : inWindow(reading, SWITCH_WINDOWS[NEUTRAL]) ? NEUTRAL
+        : inWindow(reading, SWITCH_WINDOWS[FOURLO]) ? FOURLO
+        : -1;
+}
+
+// Lookup table classifier
+// One byte per 10 bit ADC count: high nibble = motor position + 2, low nibble = switch position + 2.
+// Entries are generated by the compiler from the classify functions above (i.e. from specifications.h), so the
+// table can't get out of sync with the constants. 1kB of flash, and classifying is one pgm_read_byte.
+// tools/lut_check.cpp checks every entry against the original float volts/ohms logic.
+const uint16_t LUT_SIZE = 1024;
+
+constexpr uint8_t lutEntry(uint16_t count) {
+    return (uint8_t)(((classifyMotorReading(count << READING_SHIFT) + 2) << 4) | (classifySwitchReading(count << READING_SHIFT) + 2));
+}
+
+#define LUT_1(i) lutEntry(i)
+#define LUT_4(i) LUT_1(i), LUT_1(i+1), LUT_1(i+2), LUT_1(i+3)
+#define LUT_16(i) LUT_4(i), LUT_4(i+4), LUT_4(i+8), LUT_4(i+12)
+#define LUT_64(i) LUT_16(i), LUT_16(i+16), LUT_16(i+32), LUT_16(i+48)
+#define LUT_256(i) LUT_64(i), LUT_64(i+64), LUT_64(i+128), LUT_64(i+192)
+#define LUT_1024(i) LUT_256(i), LUT_256(i+256), LUT_256(i+512), LUT_256(i+768)
+
+const uint8_t POSITION_LUT[LUT_SIZE] PROGMEM = { LUT_1024(0) };
+
+#undef LUT_1
+#undef LUT_4
+#undef LUT_16
+#undef LUT_64
+#undef LUT_256
+#undef LUT_1024
+
+uint8_t lutLookup(reading_t reading) {
+    // Round the (averaged) reading to the nearest ADC count
+    uint16_t count = (reading + (1 << (READING_SHIFT-1))) >> READING_SHIFT;
+    return pgm_read_byte(&POSITION_LUT[count]);
+}
+
+int8_t lookupMotorPosition(reading_t reading) {
+    return (int8_t)(lutLookup(reading) >> 4) - 2;
+}
+
+int8_t lookupSwitchPosition(reading_t reading) {
+    return (int8_t)(lutLookup(reading) & 0x0F) - 2;
+}
+
+// For display only
+float readingToVolts(reading_t reading) {
+    return ADC_VIN*reading/READING_FULL_SCALE;
+}
+
+int readingToOhms(reading_t reading) {
+    if (reading == 0) {
+        return 32767;  // Open circuit
+    }
+    uint32_t ohms = ((uint32_t)SWITCH_FIXED_RESISTOR*(READING_FULL_SCALE - reading) + reading/2)/reading;
+    return (ohms > 32767) ? 32767 : ohms;
+}
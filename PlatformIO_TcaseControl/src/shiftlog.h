@@ -0,0 +1,120 @@
+#pragma once
+#include <Arduino.h>
+#include "hal.h"
+
+// Per phase shift timing
+// Each (outermost) Motor::attemptShift gets a record with the time spent in each phase, summed over retries and any
+// recovery shift. Phases are entered from the shift code (main loop) and from the control interrupt (the motion
+// phases), and the time since the last phase change is added to the phase being left.
+// The last SHIFT_LOG_SIZE shifts are kept in RAM and can be printed over Serial (the 'l' command in main.cpp).
+
+enum ShiftPhase : uint8_t {
+    PHASE_WAIT_READY,
+    PHASE_BRAKE_OFF,
+    PHASE_ACCEL,
+    PHASE_CRUISE,
+    PHASE_DECEL,
+    PHASE_SETTLE,  // Creeping at minimum power, or holding before a reversal
+    PHASE_RETRY,  // Waiting before a retry or before trying to return to the last valid position
+    PHASE_BRAKE_ON,
+    PHASE_VERIFY,
+    NUM_PHASES,
+    PHASE_NONE = NUM_PHASES
+};
+
+const char PHASE_NAMES[] PROGMEM = "wait_ready,brake_off,accel,cruise,decel,settle,retry,brake_on,verify";
+
+const byte SHIFT_LOG_SIZE = 6;  // 40 bytes of RAM each
+
+#define SHIFT_SUCCESS 0x01
+#define SHIFT_RECOVERED 0x02  // tryRecoverBadShift ran
+#define SHIFT_ABORTED 0x04
+#define SHIFT_MOTOR_WEAK 0x08  // Learned motor gain well below its baseline (see feedforward.h)
+
+struct ShiftRecord {
+    int8_t from;
+    int8_t to;
+    uint8_t retries;
+    uint8_t flags;
+    uint32_t phaseUs[NUM_PHASES];
+};
+
+class ShiftLog {
+    private:
+        ShiftRecord records[SHIFT_LOG_SIZE];
+        uint8_t count = 0;  // Records written (wraps at 256)
+        bool recording = false;
+        volatile uint8_t phase = PHASE_NONE;
+        unsigned long phaseStart = 0;
+
+        ShiftRecord &current() {
+            return records[count % SHIFT_LOG_SIZE];
+        }
+
+    public:
+        void begin(int from, int to) {
+            ShiftRecord &record = current();
+            memset(&record, 0, sizeof(record));
+            record.from = from;
+            record.to = to;
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                phase = PHASE_WAIT_READY;
+                phaseStart = micros();
+                recording = true;
+            }
+        }
+
+        void enterFromISR(uint8_t newPhase) {
+            // Control interrupt only (or with interrupts already off)
+            if (!recording || newPhase == phase) {
+                return;
+            }
+            unsigned long now = micros();
+            current().phaseUs[phase] += now - phaseStart;
+            phaseStart = now;
+            phase = newPhase;
+        }
+
+        void enter(uint8_t newPhase) {
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                enterFromISR(newPhase);
+            }
+        }
+
+        uint8_t getPhase() {
+            // PHASE_NONE when not in a shift
+            return phase;
+        }
+
+        void end(uint8_t retries, uint8_t flags) {
+            if (!recording) {
+                return;
+            }
+            enter(PHASE_NONE);
+            recording = false;
+            current().retries = retries;
+            current().flags = flags;
+            count++;
+        }
+
+        void print() {
+            // Oldest first, one CSV line per shift, times in us
+            Serial.print(F("from,to,flags,retries,"));
+            Serial.println(reinterpret_cast<const __FlashStringHelper *>(PHASE_NAMES));
+            uint8_t stored = min(count, SHIFT_LOG_SIZE);
+            for (uint8_t i = 0; i < stored; i++) {
+                ShiftRecord &record = records[(uint8_t)(count - stored + i) % SHIFT_LOG_SIZE];
+                Serial.print(record.from); Serial.print(',');
+                Serial.print(record.to); Serial.print(',');
+                Serial.print(record.flags); Serial.print(',');
+                Serial.print(record.retries);
+                for (uint8_t p = 0; p < NUM_PHASES; p++) {
+                    Serial.print(',');
+                    Serial.print(record.phaseUs[p]);
+                }
+                Serial.println();
+            }
+        }
+};
+
+ShiftLog shiftLog;
@@ -0,0 +1,26 @@
+#pragma once
+#include <Arduino.h>
+// Native stand-in for the TFT driver. Drawing does nothing: the simulator is about the shift, not the screen.
+
+#define ST7735_BLACK 0x0000
+#define ST77XX_BLACK 0x0000
+
+class Adafruit_ST7789 {
+    public:
+        Adafruit_ST7789(int8_t cs, int8_t dc, int8_t rst) {}
+        void init(uint16_t width, uint16_t height) {}
+        void setSPISpeed(uint32_t freq) {}
+        void setRotation(uint8_t rotation) {}
+        void fillScreen(uint16_t color) {}
+        void fillRect(int16_t x, int16_t y, int16_t w, int16_t h, uint16_t color) {}
+        void drawLine(int16_t x0, int16_t y0, int16_t x1, int16_t y1, uint16_t color) {}
+        void drawFastHLine(int16_t x, int16_t y, int16_t w, uint16_t color) {}
+        void drawRoundRect(int16_t x, int16_t y, int16_t w, int16_t h, int16_t r, uint16_t color) {}
+        void drawBitmap(int16_t x, int16_t y, const uint8_t *bitmap, int16_t w, int16_t h, uint16_t color) {}
+        void setCursor(int16_t x, int16_t y) {}
+        void setTextColor(uint16_t color) {}
+        void setTextSize(uint8_t size) {}
+        void setTextSize(uint8_t sx, uint8_t sy) {}
+        void setTextWrap(bool wrap) {}
+        template<class T> void print(T value) {}
+};
@@ -0,0 +1,2 @@
+#pragma once
+#include "Adafruit_ST7735.h"
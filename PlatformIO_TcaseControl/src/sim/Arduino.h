@@ -0,0 +1,83 @@
+#pragma once
+// Native stand-in for the parts of the Arduino API the firmware uses (env:native only).
+// Time, pins and analog inputs are all backed by the simulated board in sim.cpp.
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define F_CPU 16000000UL
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define LED_BUILTIN 13
+
+#define A0 14
+#define A1 15
+#define A2 16
+#define A3 17
+#define A4 18
+#define A5 19
+
+// No separate flash address space on the host
+#define PROGMEM
+#define PSTR(s) (s)
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define strncpy_P strncpy
+#define strcpy_P strcpy
+#define strlen_P strlen
+
+class __FlashStringHelper;
+#define F(s) (reinterpret_cast<const __FlashStringHelper *>(s))
+
+template<class A, class B> auto min(A a, B b) -> decltype(a + b) { return (a < b) ? a : b; }
+template<class A, class B> auto max(A a, B b) -> decltype(a + b) { return (a > b) ? a : b; }
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+void analogWrite(uint8_t pin, int value);
+int analogRead(uint8_t pin);
+
+long random(long howBig);
+long random(long howSmall, long howBig);
+void randomSeed(unsigned long seed);
+
+char *dtostrf(double value, signed char width, unsigned char precision, char *buffer);
+
+class HardwareSerial {
+    public:
+        void begin(unsigned long) {}
+        void print(const __FlashStringHelper *s) { fputs((const char *)s, stdout); }
+        void print(const char *s) { fputs(s, stdout); }
+        void print(char c) { putchar(c); }
+        void print(int v) { printf("%d", v); }
+        void print(unsigned int v) { printf("%u", v); }
+        void print(long v) { printf("%ld", v); }
+        void print(unsigned long v) { printf("%lu", v); }
+        void print(double v, int digits = 2) { printf("%.*f", digits, v); }
+        template<class T> void println(T v) { print(v); putchar('\n'); }
+        void println() { putchar('\n'); }
+        size_t write(uint8_t c) { putchar(c); return 1; }
+        size_t write(const uint8_t *buffer, size_t size) { return fwrite(buffer, 1, size, stdout); }
+        int availableForWrite() { return 64; }
+        int available() { return 0; }
+        int read() { return -1; }
+        void flush() { fflush(stdout); }
+};
+
+extern HardwareSerial Serial;
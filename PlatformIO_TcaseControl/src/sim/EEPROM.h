@@ -0,0 +1,21 @@
+#pragma once
+#include <stdint.h>
+// Native stand-in for the Arduino EEPROM library (1kB, erased to 0xFF like a new chip)
+
+class EEPROMClass {
+    private:
+        uint8_t data[1024];
+
+    public:
+        EEPROMClass() {
+            for (uint16_t i = 0; i < sizeof(data); i++) {
+                data[i] = 0xFF;
+            }
+        }
+        uint8_t read(int address) { return data[address & 1023]; }
+        void write(int address, uint8_t value) { data[address & 1023] = value; }
+        void update(int address, uint8_t value) { write(address, value); }
+        uint16_t length() { return sizeof(data); }
+};
+
+extern EEPROMClass EEPROM;
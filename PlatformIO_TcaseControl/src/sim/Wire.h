@@ -0,0 +1,2 @@
+#pragma once
+// Native stand-in (not used by the firmware classes, only included)
@@ -0,0 +1,29 @@
+#pragma once
+#include <stdint.h>
+// Native side of hal.h. The peripherals are simulated in sim.cpp, which calls the interrupt handlers the firmware
+// defines with HAL_ADC_INTERRUPT / HAL_CONTROL_INTERRUPT / HAL_EEPROM_INTERRUPT / HAL_MOTOR_PWM_INTERRUPT as simulated time passes.
+
+void halAdcSetChannel(uint8_t pin);
+void halAdcStartFreeRunning();
+void halAdcStopFreeRunning();
+uint16_t halAdcResult();
+void halAdcSingleAsleep();
+void halAdcOff();
+void halControlTimerBegin(uint8_t top);
+void halControlTimerEnable(bool enable);
+void halMotorPwmBegin(uint16_t top, uint8_t clockSelect, bool phaseCorrect);
+void halMotorPwmEnable(bool enable);
+void halWaitForInterrupt();
+void halSleep();
+void halEepromWrite(uint16_t address, uint8_t value);
+void halEepromReadyInterrupt(bool enable);
+
+void halAdcInterrupt();
+void halControlInterrupt();
+void halEepromInterrupt();
+void halMotorPwmInterrupt();
+
+#define HAL_ADC_INTERRUPT void halAdcInterrupt()
+#define HAL_CONTROL_INTERRUPT void halControlInterrupt()
+#define HAL_EEPROM_INTERRUPT void halEepromInterrupt()
+#define HAL_MOTOR_PWM_INTERRUPT void halMotorPwmInterrupt()
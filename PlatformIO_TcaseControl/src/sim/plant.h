@@ -0,0 +1,280 @@
+#pragma once
+#include <math.h>
+#include <stdint.h>
+#include <random>
+#include <vector>
+
+// Simulated NV244 transfer case shift motor (env:native only)
+// Shaft travel x runs 0 -> 1 between the end stops (4LO end -> 4HI end). The motor is a first order DC motor:
+//   dv/dt = (noLoadSpeed*(V_applied - friction)/supplyVolts - v)/timeConstant
+// with Coulomb friction expressed as volts (the motor won't start below frictionVolts), a brake that locks the shaft
+// while engaged, and optionally a jam part way along that blocks the shaft until it has been pushed on for a while
+// (gear teeth not lining up). With the brake off and no drive, a detent within detentRadius pulls the shaft to its
+// centre. The mode sensor is a slightly non-linear pot plus gaussian noise, optionally offset (sensor drift: the
+// detents stay put but read differently).
+
+const uint32_t NOISE_TABLE_SIZE = 4096;  // Power of 2
+const int BOW_TABLE_SIZE = 1024;  // sin(2*pi*travel), interpolated (error ~5e-6 of sensorBowVolts)
+
+struct PlantParams {
+    double supplyVolts = 12.0;
+    double noLoadSpeed = 1.5;  // Travel/s at supplyVolts (so a 0.28 travel shift takes ~0.3s at PWM 180)
+    double timeConstant = 0.04;  // s
+    double frictionVolts = 1.5;
+    double sensorLowVolts = 1.2;  // Sensor voltage at x = 0
+    double sensorSpanVolts = 3.2;  // Sensor voltage increase from x = 0 to x = 1
+    double sensorBowVolts = 0.05;  // Non-linearity (sine term)
+    double sensorNoiseVolts = 0.005;  // Standard deviation
+    double sensorOffsetVolts = 0.0;  // Drift, added to every sensor reading
+    double detentRadius = 0.1;  // Travel either side of a detent that it pulls in from
+    double detentSpeed = 0.3;  // Travel/s
+};
+
+class TcasePlant {
+    private:
+        PlantParams params;
+        std::mt19937 rng;
+        std::vector<double> noise;  // Standard normal deviates, picked at random for each conversion (far cheaper than
+                                    // drawing a fresh one ~10k times a simulated second)
+        uint32_t noisePick = 1;  // xorshift32 state for picking them
+        double bow[BOW_TABLE_SIZE + 1];
+        double x = 0.5;
+        double v = 0.0;
+        double cachedVolts = 0.0;  // sensorVoltsAt(x), so each conversion doesn't need a sin()
+        double cachedX = -1.0;
+        double appliedVolts = 0.0;
+        bool brakeEngaged = true;
+        bool jamActive = false;
+        double jamX = 0.0;
+        double jamLeft = 0.0;  // s of pushing still needed to clear the jam
+        double jamDirection = 0.0;  // Direction the shaft was moving when it hit the jam (0 = not at the jam)
+        std::vector<double> detents;  // Travel of each detent centre
+
+        // Stats since resetStats()
+        double minX = 0.0;  // Travel rather than volts, so stepping doesn't need a sin() (sensorVoltsAt is monotonic)
+        double maxX = 0.0;
+        bool driving = false;
+        double driveStart = -1.0;
+        double driveEnd = -1.0;
+        double time = 0.0;
+
+        void settleIntoDetent(double dt) {
+            for (double centre : detents) {
+                double offset = centre - x;
+                if (fabs(offset) < params.detentRadius) {
+                    double step = params.detentSpeed*dt;
+                    x = (fabs(offset) <= step) ? centre : x + copysign(step, offset);
+                    trackVolts();
+                    return;
+                }
+            }
+        }
+
+        void trackVolts() {
+            minX = fmin(minX, x);
+            maxX = fmax(maxX, x);
+        }
+
+    public:
+        TcasePlant(uint32_t seed = 1) : rng(seed), noise(NOISE_TABLE_SIZE) {
+            std::normal_distribution<double> normal(0.0, 1.0);
+            for (double &n : noise) {
+                n = normal(rng);
+            }
+            noisePick = rng() | 1;
+            for (int i = 0; i <= BOW_TABLE_SIZE; i++) {
+                bow[i] = sin(2*M_PI*i/BOW_TABLE_SIZE);
+            }
+        }
+
+        void setParams(const PlantParams &newParams) {
+            params = newParams;
+            cachedX = -1.0;
+        }
+
+        const PlantParams &getParams() {
+            return params;
+        }
+
+        void reseed(uint32_t seed) {
+            rng.seed(seed);
+            noisePick = seed | 1;
+        }
+
+        std::mt19937 &random() {
+            return rng;
+        }
+
+        void setDetents(const std::vector<double> &travel) {
+            detents = travel;
+        }
+
+        void setPositionVolts(double volts) {
+            // Put the shaft where the sensor reads volts (ignoring the bow term and any offset, close enough for a
+            // starting point)
+            x = fmin(fmax((volts - params.sensorLowVolts)/params.sensorSpanVolts, 0.0), 1.0);
+            v = 0.0;
+        }
+
+        double travelForVolts(double volts) {
+            // Where the sensor reads volts with no offset (bisection, the bow term is small enough to keep it monotonic)
+            double low = 0.0, high = 1.0;
+            for (int i = 0; i < 40; i++) {
+                double mid = 0.5*(low + high);
+                if (sensorVoltsAt(mid) - params.sensorOffsetVolts < volts) {
+                    low = mid;
+                } else {
+                    high = mid;
+                }
+            }
+            return 0.5*(low + high);
+        }
+
+        void setDrive(double volts) {
+            // Average volts across the motor (+ve drives toward the 4HI end)
+            appliedVolts = volts;
+            if (volts != 0.0 && !driving && driveStart < 0.0) {
+                driveStart = time;
+            }
+            if (volts == 0.0 && driving) {
+                driveEnd = time;
+            }
+            driving = (volts != 0.0);
+        }
+
+        void setBrake(bool engaged) {
+            brakeEngaged = engaged;
+        }
+
+        void setJam(double travel, double clearTime) {
+            jamActive = true;
+            jamX = travel;
+            jamLeft = clearTime;
+            jamDirection = 0.0;
+        }
+
+        void clearJam() {
+            jamActive = false;
+        }
+
+        bool isStill() {
+            // Undriven and going nowhere (brake on, or settled in or away from a detent): step() would only move time
+            if (appliedVolts != 0.0) {
+                return false;
+            }
+            if (brakeEngaged) {
+                return true;
+            }
+            if (v != 0.0) {
+                return false;
+            }
+            for (double centre : detents) {
+                if (fabs(centre - x) < params.detentRadius) {
+                    return x == centre;
+                }
+            }
+            return true;
+        }
+
+        void idle(double dt) {
+            // Same as dt worth of step() while isStill()
+            time += dt;
+        }
+
+        void step(double dt) {
+            time += dt;
+            if (brakeEngaged) {
+                v = 0.0;
+                return;
+            }
+            if (jamDirection != 0.0 && appliedVolts*jamDirection > 0.0) {  // Pushing against the jam
+                v = 0.0;
+                if (fabs(appliedVolts) > params.frictionVolts) {
+                    jamLeft -= dt;
+                }
+                if (jamLeft <= 0.0) {
+                    jamActive = false;
+                    jamDirection = 0.0;
+                }
+                return;
+            }
+            if (v == 0.0 && appliedVolts == 0.0) {
+                settleIntoDetent(dt);
+                return;
+            }
+            if (v == 0.0 && fabs(appliedVolts) <= params.frictionVolts) {
+                return;  // Static friction holds it
+            }
+            double direction = (v != 0.0) ? copysign(1.0, v) : copysign(1.0, appliedVolts);
+            double target = params.noLoadSpeed*(appliedVolts - direction*params.frictionVolts)/params.supplyVolts;
+            double newV = v + (target - v)*dt/params.timeConstant;
+            if (appliedVolts == 0.0 && newV*v <= 0.0) {
+                newV = 0.0;  // Friction stops it, doesn't reverse it
+            }
+            v = newV;
+            double newX = x + v*dt;
+            jamDirection = 0.0;
+            if (jamActive && v != 0.0 && (x - jamX)*(newX - jamX) <= 0.0 && x != jamX) {  // Hit the jam
+                newX = jamX;
+                jamDirection = copysign(1.0, v);
+                v = 0.0;
+            }
+            if (newX <= 0.0 || newX >= 1.0) {  // End stops
+                newX = fmin(fmax(newX, 0.0), 1.0);
+                v = 0.0;
+            }
+            x = newX;
+            trackVolts();
+        }
+
+        double sensorVoltsAt(double travel) {
+            double at = fmin(fmax(travel, 0.0), 1.0)*BOW_TABLE_SIZE;
+            int i = (at < BOW_TABLE_SIZE) ? (int)at : BOW_TABLE_SIZE - 1;
+            double sine = bow[i] + (at - i)*(bow[i + 1] - bow[i]);
+            return params.sensorOffsetVolts + params.sensorLowVolts + params.sensorSpanVolts*travel + params.sensorBowVolts*sine;
+        }
+
+        double sensorVolts() {
+            if (x != cachedX) {
+                cachedX = x;
+                cachedVolts = sensorVoltsAt(x);
+            }
+            return cachedVolts;
+        }
+
+        double noisySensorVolts() {
+            noisePick ^= noisePick << 13;
+            noisePick ^= noisePick >> 17;
+            noisePick ^= noisePick << 5;
+            return sensorVolts() + params.sensorNoiseVolts*noise[noisePick & (NOISE_TABLE_SIZE - 1)];
+        }
+
+        void resetStats() {
+            minX = maxX = x;
+            driveStart = -1.0;
+            driveEnd = -1.0;
+            if (appliedVolts != 0.0) {
+                driveStart = time;
+            }
+        }
+
+        double getMinVolts() {
+            return sensorVoltsAt(minX);
+        }
+
+        double getMaxVolts() {
+            return sensorVoltsAt(maxX);
+        }
+
+        double getDriveTime() {
+            // Time from the motor first being driven to it last being stopped (since resetStats)
+            if (driveStart < 0.0) {
+                return 0.0;
+            }
+            return (driving ? time : driveEnd) - driveStart;
+        }
+
+        double getVelocity() {
+            return v;
+        }
+};
@@ -0,0 +1,322 @@
+#include "sim.h"
+#include <Arduino.h>
+#include <EEPROM.h>
+#include "hal_native.h"
+
+HardwareSerial Serial;
+EEPROMClass EEPROM;
+
+static TcasePlant *plant = nullptr;
+static SimConfig config;
+static uint64_t now = 0;
+static uint64_t nextPlant = 0;  // UINT64_MAX while the plant is still (see updateDrive)
+static uint64_t plantStillSince = 0;  // Step the plant went still at
+static uint64_t nextEvent = 0;  // Earliest of nextPlant/nextAdc/nextControl/nextPwm/eepromReadyAt, so most calls don't need the full loop
+
+static uint8_t pinValues[32];
+static uint16_t pwmValues[32];  // OCR values
+
+static double switchOhms = 1e6;
+static const double SWITCH_FIXED_OHMS = 4675;  // Lower leg of the switch voltage divider (SWITCH_FIXED_RESISTOR, see readingToOhms)
+
+static bool adcRunning = false;
+static bool adcSingle = false;  // Stop after the conversion in progress
+static unsigned long adcConversions = 0;
+static uint8_t adcMux = 0;
+static uint8_t adcConverting = 0;  // Pin of the conversion in progress
+static uint16_t adcResult = 0;
+static uint64_t nextAdc = 0;
+
+static bool controlRunning = false;
+static uint32_t controlPeriodUs = 0;
+static uint64_t nextControl = 0;
+
+static uint32_t pwmPeriodUs = 1024;
+static uint16_t pwmTop = 255;  // Of the motor PWM pin (8 bit, as the Arduino core sets the timers up, until halMotorPwmBegin)
+static bool pwmInterrupt = false;
+static uint64_t nextPwm = 0;
+
+static bool eepromInterrupt = false;
+static uint64_t eepromReadyAt = 0;  // Write in progress until then
+static unsigned long eepromWrites = 0;
+
+static std::mt19937 boardRng(1);
+
+static void updateNextEvent() {
+    nextEvent = nextPlant;
+    if (adcRunning && nextAdc < nextEvent) nextEvent = nextAdc;
+    if (controlRunning && nextControl < nextEvent) nextEvent = nextControl;
+    if (pwmInterrupt && nextPwm < nextEvent) nextEvent = nextPwm;
+    if (eepromInterrupt && eepromReadyAt < nextEvent) nextEvent = (eepromReadyAt > now) ? eepromReadyAt : now;
+}
+
+static double pinVolts(uint8_t pin) {
+    if (pin == config.pins.modeSensor) {
+        return plant->noisySensorVolts();
+    }
+    if (pin == config.pins.switchSensor) {
+        return 5.0*SWITCH_FIXED_OHMS/(switchOhms + SWITCH_FIXED_OHMS);  // Switch between 5V and the pin, fixed resistor to ground
+    }
+    return 0.0;
+}
+
+static uint16_t convert(uint8_t pin) {
+    // (Called for every conversion, ~10k/s, so the plant caches its noise free sensor voltage)
+    long count = lround(pinVolts(pin)*1023.0/5.0);
+    return (count < 0) ? 0 : (count > 1023) ? 1023 : count;
+}
+
+static void updateDrive() {
+    if (nextPlant == UINT64_MAX) {  // Still since plantStillSince: catch its clock up and step it again from here
+        uint64_t steps = (now - plantStillSince)/config.plantStepUs;
+        plant->idle(steps*config.plantStepUs*1e-6);
+        nextPlant = plantStillSince + (steps + 1)*config.plantStepUs;
+        updateNextEvent();
+    }
+    double duty = fmin(pwmValues[config.pins.pwm]/(double)pwmTop, 1.0);
+    double direction = pinValues[config.pins.dir] ? -1.0 : 1.0;  // Dir pin high (TOWARD_4LO) lowers the sensor voltage
+    plant->setDrive(direction*duty*plant->getParams().supplyVolts);
+    plant->setBrake(pinValues[config.pins.brakeRelease] == LOW);
+}
+
+void simBegin(TcasePlant *simPlant, const SimConfig &simConfig) {
+    plant = simPlant;
+    config = simConfig;
+    now = 0;
+    nextPlant = config.plantStepUs;
+    memset(pinValues, 0, sizeof(pinValues));
+    memset(pwmValues, 0, sizeof(pwmValues));
+    pwmTop = 255;
+    pwmPeriodUs = 1024;
+    adcRunning = false;
+    controlRunning = false;
+    pwmInterrupt = false;
+    eepromInterrupt = false;
+    eepromReadyAt = 0;
+    updateNextEvent();
+    updateDrive();
+}
+
+uint64_t simNowUs() {
+    return now;
+}
+
+unsigned long simAdcConversions() {
+    return adcConversions;
+}
+
+unsigned long simEepromWrites() {
+    return eepromWrites;
+}
+
+void simSetSwitchOhms(double ohms) {
+    switchOhms = ohms;
+}
+
+void simAdvance(uint32_t us) {
+    uint64_t end = now + us;
+    if (end < nextEvent) {  // Nothing happens in between
+        now = end;
+        return;
+    }
+    while (true) {
+        uint64_t next = (nextEvent < end) ? nextEvent : end;
+        now = next;
+        if (now == nextPlant) {
+            plant->step(config.plantStepUs*1e-6);
+            nextPlant += config.plantStepUs;
+            if (plant->isStill()) {  // Nothing to step until the drive or brake changes (updateDrive)
+                plantStillSince = now;
+                nextPlant = UINT64_MAX;
+            }
+        }
+        if (adcRunning && now == nextAdc) {
+            adcResult = convert(adcConverting);
+            adcConversions++;
+            adcConverting = adcMux;  // Free running: the next conversion starts straight away with the current mux
+            nextAdc += config.adcConversionUs;
+            adcRunning = !adcSingle;
+            halAdcInterrupt();
+        }
+        if (controlRunning && now == nextControl) {
+            nextControl += controlPeriodUs;
+            halControlInterrupt();
+        }
+        if (pwmInterrupt && now == nextPwm) {
+            nextPwm += pwmPeriodUs;
+            halMotorPwmInterrupt();
+        }
+        if (eepromInterrupt && now >= eepromReadyAt) {
+            halEepromInterrupt();
+        }
+        updateNextEvent();
+        if (now >= end) {
+            return;
+        }
+    }
+}
+
+// hal.h
+
+void halAdcSetChannel(uint8_t pin) {
+    adcMux = pin;
+}
+
+void halAdcStartFreeRunning() {
+    adcRunning = true;
+    adcSingle = false;
+    adcConverting = adcMux;
+    nextAdc = now + config.adcConversionUs;
+    updateNextEvent();
+}
+
+void halAdcStopFreeRunning() {
+    adcRunning = false;
+    updateNextEvent();
+}
+
+uint16_t halAdcResult() {
+    return adcResult;
+}
+
+void halAdcSingleAsleep() {
+    // (The CPU isn't modelled as stopping, the conversion just completes later like a free running one)
+    adcRunning = true;
+    adcSingle = true;
+    adcConverting = adcMux;
+    nextAdc = now + config.adcConversionUs;
+    updateNextEvent();
+}
+
+void halAdcOff() {
+    adcRunning = false;
+    updateNextEvent();
+}
+
+void halControlTimerBegin(uint8_t top) {
+    controlPeriodUs = (top + 1)*128UL/(F_CPU/1000000UL);
+    nextControl = now + controlPeriodUs;
+    controlRunning = true;
+    updateNextEvent();
+}
+
+void halControlTimerEnable(bool enable) {
+    if (enable && !controlRunning) {
+        nextControl = now + controlPeriodUs;
+    }
+    controlRunning = enable;
+    updateNextEvent();
+}
+
+void halMotorPwmBegin(uint16_t top, uint8_t clockSelect, bool phaseCorrect) {
+    // Timer1 with ICR1 = top (the period only matters for when the overflow interrupt runs, the plant sees the average)
+    static const uint16_t prescalers[6] = {0, 1, 8, 64, 256, 1024};
+    pwmTop = top;
+    pwmPeriodUs = (uint32_t)prescalers[clockSelect]*(phaseCorrect ? 2UL*top : top + 1UL)/(F_CPU/1000000UL);
+    nextPwm = now + pwmPeriodUs - now % pwmPeriodUs;
+    pwmInterrupt = true;
+    updateNextEvent();
+}
+
+void halMotorPwmEnable(bool enable) {
+    if (enable && !pwmInterrupt) {
+        nextPwm = now + pwmPeriodUs - now % pwmPeriodUs;
+    }
+    pwmInterrupt = enable;
+    updateNextEvent();
+}
+
+void halEepromWrite(uint16_t address, uint8_t value) {
+    EEPROM.write(address, value);
+    eepromReadyAt = now + config.eepromWriteUs;
+    eepromWrites++;
+}
+
+void halEepromReadyInterrupt(bool enable) {
+    eepromInterrupt = enable;
+    updateNextEvent();
+}
+
+static void advanceToInterrupt(bool adcWakes) {
+    // Until the next simulated interrupt, or the next Timer0 overflow (every 1024us) on the board
+    uint64_t wake = now + 1024 - now % 1024;
+    if (adcRunning && adcWakes && nextAdc < wake) wake = nextAdc;
+    if (controlRunning && nextControl < wake) wake = nextControl;
+    if (pwmInterrupt && nextPwm < wake) wake = nextPwm;
+    if (eepromInterrupt && eepromReadyAt < wake) wake = eepromReadyAt;
+    simAdvance((wake > now + config.callCostUs) ? wake - now : config.callCostUs);
+}
+
+void halWaitForInterrupt() {
+    // Nothing the caller is waiting for can change before an interrupt, so skip straight to it. Free running
+    // conversions only fill the sample buffers, which nothing outside the interrupts looks at more often than
+    // millis() changes, so those wakes are skipped (they're most of them): waits run ~10x fewer passes
+    advanceToInterrupt(adcSingle);
+}
+
+void halSleep() {
+    advanceToInterrupt(true);
+}
+
+// Arduino API
+
+unsigned long millis() {
+    simAdvance(config.callCostUs);
+    return now/1000;
+}
+
+unsigned long micros() {
+    simAdvance(config.callCostUs);
+    return now;
+}
+
+void delay(unsigned long ms) {
+    simAdvance(ms*1000);
+}
+
+void delayMicroseconds(unsigned int us) {
+    simAdvance(us);
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+    pinValues[pin & 31] = value ? HIGH : LOW;
+    if ((pin & 31) == config.pins.pwm) {
+        pwmValues[pin & 31] = value ? pwmTop : 0;
+    }
+    updateDrive();
+}
+
+int digitalRead(uint8_t pin) {
+    return pinValues[pin & 31];
+}
+
+void analogWrite(uint8_t pin, int value) {
+    pwmValues[pin & 31] = constrain(value, 0, 65535);  // The OCR register (16 bit on Timer1)
+    pinValues[pin & 31] = value > 0;
+    updateDrive();
+}
+
+int analogRead(uint8_t pin) {
+    simAdvance(config.adcConversionUs + 8);
+    return convert(pin);
+}
+
+long random(long howBig) {
+    return (howBig > 0) ? (long)(boardRng() % howBig) : 0;
+}
+
+long random(long howSmall, long howBig) {
+    return howSmall + random(howBig - howSmall);
+}
+
+void randomSeed(unsigned long seed) {
+    boardRng.seed(seed);
+}
+
+char *dtostrf(double value, signed char width, unsigned char precision, char *buffer) {
+    sprintf(buffer, "%*.*f", width, precision, value);
+    return buffer;
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include <stdint.h>
+#include "plant.h"
+
+// Simulated board for the native build (env:native)
+// Time is virtual: it only moves when the firmware asks for it (millis/micros/delay/analogRead each cost
+// SimConfig::callCostUs), so the firmware's own busy loops drive the simulation and it runs as fast as the host can.
+// As time passes the ADC conversions, the Timer2 control interrupt, EEPROM writes and the plant are stepped in order.
+// Where the firmware only waits for an interrupt (halWaitForInterrupt(), halSleep()) the clock jumps straight to the
+// next one, and a plant sitting still (motor off, settled) isn't stepped until the motor drives it again.
+
+struct SimPins {
+    uint8_t pwm = 9;  // OC1A
+    uint8_t dir = 7;
+    uint8_t brakeRelease = 4;
+    uint8_t modeSensor = 15;  // A1
+    uint8_t switchSensor = 14;  // A0
+};
+
+struct SimConfig {
+    SimPins pins;
+    uint32_t callCostUs = 4;  // Time each millis()/micros() call takes
+    uint32_t plantStepUs = 100;
+    uint32_t adcConversionUs = 104;  // 13 ADC clocks at 125kHz
+    uint32_t eepromWriteUs = 3400;  // Erase + write of one EEPROM byte
+};
+
+void simBegin(TcasePlant *plant, const SimConfig &config);
+void simAdvance(uint32_t us);
+uint64_t simNowUs();
+void simSetSwitchOhms(double ohms);
+unsigned long simAdcConversions();  // Conversions completed (free running or single)
+unsigned long simEepromWrites();  // Bytes written through halEepromWrite
@@ -0,0 +1,350 @@
+// Shift simulator (env:native)
+// Runs the real Motor/MotorControl/AdcSampler code against the simulated transfer case in plant.h and reports shift
+// time, overshoot and retry/failure rates, for each motion profile asked for.
+//
+//   pio run -e native && .pio/build/native/program -n 2000 -p both -j 0.1
+//
+// Options: -n shifts per profile (default 1000), -s seed, -p steps|trapezoid|both, -j probability of a shift hitting
+// a jam (default 0), -c simulated us per millis()/micros() call, -v print every shift (CSV), -T write the binary
+// telemetry stream to stdout, followed by the stored history dump ('h') at the end (results go to stderr, decode
+// with tools/telemetry_decode), -o mode sensor offset in volts (drift, the detents stay at the specifications.h
+// positions), -C run Motor::calibrate() first and compare what it learned with the simulated detents, -w multiply
+// the motor's speed by this half way through each run (a motor wearing out, see feedforward.h), -i park and move
+// the selector this many times, reporting the wake latency (see idle.h), then toggle into Neutral and check that it
+// parks on the detent the knob springs back to
+//
+// test/test_sim runs fixed seed batches through the same code (simrun.h) and checks the results: pio test -e native
+#include <Arduino.h>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include "simrun.h"
+#include "specifications.h"
+#include "output.h"
+#include "switch.h"
+#include "motor.h"
+#include "idle.h"
+
+const uint8_t TFT_CS = 10, TFT_DC = 6, TFT_RST = 8;
+const uint8_t switchModePin = A0;
+const uint8_t motorModePin = A1;
+
+Adafruit_ST7789 tft = Adafruit_ST7789(TFT_CS, TFT_DC, TFT_RST);
+OtherOutputs output = OtherOutputs(&tft);
+SelectorSwitch selector = SelectorSwitch(switchModePin, &output);
+Motor motor = Motor(motorModePin, &output);
+
+const float POSITION_VOLTS[4] = {LOCK_V, AWD_V, N_V, LO_V};
+const double SWITCH_OHMS[4] = {
+    (SW_LOCK_LOW + SW_LOCK_HIGH)/2.0, (SW_AWD_LOW + SW_AWD_HIGH)/2.0, (SW_N_LOW + SW_N_HIGH)/2.0, (SW_LO_LOW + SW_LO_HIGH)/2.0
+};
+
+
+FILE *report = stdout;
+
+void flushTelemetry() {
+    telemetry.flush();
+}
+
+void saveMotorModel() {
+    feedForward.saveIfChanged();
+}
+
+void saveShiftHistory() {
+    shiftHistory.flush();
+}
+
+
+double percentile(std::vector<double> values, double p) {
+    if (values.empty()) {
+        return 0.0;
+    }
+    std::sort(values.begin(), values.end());
+    return values[(size_t)(p*(values.size() - 1) + 0.5)];
+}
+
+double mean(const std::vector<double> &values) {
+    double sum = 0.0;
+    for (double value : values) {
+        sum += value;
+    }
+    return values.empty() ? 0.0 : sum/values.size();
+}
+
+RunStats runProfile(TcasePlant &plant, byte profile, const Options &options) {
+    const char *name = (profile == PROFILE_STEPS) ? "steps" : "trapezoid";
+    RunStats stats;
+    plant.reseed(options.seed);  // Same targets/jams/noise for every profile
+    plant.clearJam();
+    plant.setPositionVolts(AWD_V);
+    motorControl.setProfile(profile);
+    std::uniform_int_distribution<int> pickOffset(1, 3);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    int current = AWD;
+    PlantParams healthy = plant.getParams();
+    long weakShifts = 0;
+
+    auto hostStart = std::chrono::steady_clock::now();
+    uint64_t simStart = simNowUs();
+    for (long i = 0; i < options.shifts; i++) {
+        if (i == options.shifts/2 && options.weaken != 1.0) {
+            PlantParams weakened = healthy;
+            weakened.noLoadSpeed *= options.weaken;
+            plant.setParams(weakened);
+        }
+        int target = (current + pickOffset(plant.random())) % 4;
+        double startVolts = plant.sensorVolts();
+        double targetVolts = readingToVolts(calibration.target(target));  // Where the firmware aims (spec until calibrated)
+        if (uniform(plant.random()) < options.jamProbability) {
+            double along = 0.2 + 0.6*uniform(plant.random());
+            double jamVolts = startVolts + along*(targetVolts - startVolts);
+            plant.setJam(plant.travelForVolts(jamVolts), 0.05 + 3.0*uniform(plant.random()));
+        }
+        simSetSwitchOhms(SWITCH_OHMS[target]);
+        plant.resetStats();
+        unsigned long retriesBefore = motor.getRetryCount();
+        uint64_t t0 = simNowUs();
+        bool success = motor.attemptShift(target, MAX_SINGLE_SHIFT_ATTEMPTS);
+        double shiftMs = (simNowUs() - t0)/1000.0;
+        plant.clearJam();
+        weakShifts += feedForward.isWeak();
+
+        double overshoot = (targetVolts > startVolts) ? plant.getMaxVolts() - targetVolts : targetVolts - plant.getMinVolts();
+        overshoot = fmax(overshoot, 0.0)*1000.0;
+        unsigned long retries = motor.getRetryCount() - retriesBefore;
+        stats.shiftMs.push_back(shiftMs);
+        stats.motionMs.push_back(plant.getDriveTime()*1000.0);
+        stats.overshootMv.push_back(overshoot);
+        stats.retries += retries;
+        stats.retried += (retries > 0);
+        if (success) {
+            stats.succeeded++;
+        } else {
+            stats.failed++;
+        }
+        if (options.verbose) {
+            fprintf(report, "%s,%ld,%d,%d,%d,%.1f,%.1f,%.1f,%lu\n", name, i, current, target, success, shiftMs, plant.getDriveTime()*1000.0, overshoot, retries);
+        }
+        int position = motor.getPosition();
+        current = isValid(position) ? position : target;
+    }
+    PlantParams params = plant.getParams();  // (Truth at the end of the run)
+    plant.setParams(healthy);
+    double hostS = std::chrono::duration<double>(std::chrono::steady_clock::now() - hostStart).count();
+    double simS = (simNowUs() - simStart)/1e6;
+
+    fprintf(report, "%-10s shifts %ld  ok %.1f%%  failed %ld  retried %.1f%% (%lu retries)\n", name, options.shifts,
+        100.0*stats.succeeded/options.shifts, stats.failed, 100.0*stats.retried/options.shifts, stats.retries);
+    fprintf(report, "           shift ms   mean %7.1f  p50 %7.1f  p95 %7.1f  max %7.1f\n", mean(stats.shiftMs),
+        percentile(stats.shiftMs, 0.5), percentile(stats.shiftMs, 0.95), percentile(stats.shiftMs, 1.0));
+    fprintf(report, "           motion ms  mean %7.1f  p50 %7.1f  p95 %7.1f  max %7.1f\n", mean(stats.motionMs),
+        percentile(stats.motionMs, 0.5), percentile(stats.motionMs, 0.95), percentile(stats.motionMs, 1.0));
+    fprintf(report, "           overshoot mV mean %5.1f  p95 %7.1f  max %7.1f\n", mean(stats.overshootMv),
+        percentile(stats.overshootMv, 0.95), percentile(stats.overshootMv, 1.0));
+    // Plant truth: no motion below frictionVolts, then noLoadSpeed*span per supplyVolts (ignoring the sensor bow)
+    fprintf(report, "           model 4HI deadband %d gain %.4f  4LO deadband %d gain %.4f V/s per PWM  (plant %.1f, %.4f)  weak %ld\n",
+        feedForward.deadband(TOWARD_4HI), feedForward.velocityPerPwm(TOWARD_4HI),
+        feedForward.deadband(TOWARD_4LO), feedForward.velocityPerPwm(TOWARD_4LO),
+        255*params.frictionVolts/params.supplyVolts, params.noLoadSpeed*params.sensorSpanVolts/255, weakShifts);
+    fprintf(report, "           %.0f simulated s in %.2f s (%.0fx real time, %.0f shifts/s)\n", simS, hostS, simS/hostS, options.shifts/hostS);
+    return stats;
+}
+
+void idleLoop() {
+    // What loop()/normal() do while parked
+    scheduler.run();
+    if (!idleMode.sleep(selector.getConfirmedState())) {
+        selector.checkState();
+        if (!selector.isSettled()) {
+            idleMode.activity();
+        }
+        delay(1);
+    }
+}
+
+void runIdle(TcasePlant &plant, const Options &options) {
+    // Park, then move the selector at a random time and see how long it takes to wake and to select
+    std::uniform_int_distribution<int> pickOffset(1, 3);
+    std::uniform_int_distribution<int> pickDelayMs(0, 2000);
+    std::vector<double> wakeMs, selectMs;
+    double parkedS = 0.0;
+    unsigned long parkedConversions = 0;
+    int position = AWD;  // (runProfile may have left the knob held on Neutral)
+    simSetSwitchOhms(SWITCH_OHMS[position]);
+    idleMode.begin(switchModePin);
+    uint64_t activeStart = simNowUs();
+    unsigned long activeConversions = simAdcConversions();
+    while (!idleMode.isIdle()) {
+        idleLoop();
+    }
+    double activeS = (simNowUs() - activeStart)/1e6;
+    activeConversions = simAdcConversions() - activeConversions;
+    for (long i = 0; i < options.idleTrials; i++) {
+        while (!idleMode.isIdle()) {
+            idleLoop();
+        }
+        uint64_t parkedStart = simNowUs();
+        unsigned long conversions = simAdcConversions();
+        uint64_t moveAt = simNowUs() + pickDelayMs(plant.random())*1000ULL;
+        while (simNowUs() < moveAt) {
+            idleLoop();
+        }
+        parkedS += (simNowUs() - parkedStart)/1e6;
+        parkedConversions += simAdcConversions() - conversions;
+        int next;
+        do {  // (Neutral is a press, not a selection)
+            next = (position + pickOffset(plant.random())) % 4;
+        } while (next == NEUTRAL);
+        position = next;
+        simSetSwitchOhms(SWITCH_OHMS[position]);
+        uint64_t moved = simNowUs();
+        while (idleMode.isIdle()) {
+            idleLoop();
+        }
+        wakeMs.push_back((simNowUs() - moved)/1000.0);
+        while (selector.getLastValidState() != position) {
+            idleLoop();
+        }
+        selectMs.push_back((simNowUs() - moved)/1000.0);
+    }
+    fprintf(report, "idle       %ld wakes  wake ms mean %.1f max %.1f (idleMode measured max %.1f)  selected ms mean %.1f max %.1f  debounce %lu\n",
+        options.idleTrials, mean(wakeMs), percentile(wakeMs, 1.0), idleMode.getMaxWakeUs()/1000.0, mean(selectMs),
+        percentile(selectMs, 1.0), SW_DEBOUNCE_MS);
+    fprintf(report, "           adc conversions/s  active %.0f  parked %.0f\n", activeConversions/activeS,
+        parkedS > 0.0 ? parkedConversions/parkedS : 0.0);
+
+    // Neutral: hold the knob on N until it toggles and let it spring back. The selection is then Neutral but the
+    // knob is on its old detent, which is what it has to park on (and stay parked)
+    simSetSwitchOhms(SWITCH_OHMS[NEUTRAL]);
+    uint64_t releaseAt = simNowUs() + (SW_DEBOUNCE_MS + SW_N_PRESS_MS + 100)*1000ULL;
+    while (simNowUs() < releaseAt) {
+        idleLoop();
+    }
+    simSetSwitchOhms(SWITCH_OHMS[position]);
+    while (selector.getLastValidState() != NEUTRAL || !selector.isSettled()) {
+        idleLoop();
+    }
+    uint64_t quietEnd = simNowUs() + (IDLE_QUIET_MS + 1000)*1000ULL;
+    while (simNowUs() < quietEnd) {
+        idleLoop();
+    }
+    uint32_t wakes = idleMode.getWakes();
+    uint64_t neutralStart = simNowUs();
+    uint64_t neutralParkedUs = 0;
+    while (simNowUs() - neutralStart < 3*IDLE_QUIET_MS*1000ULL) {
+        uint64_t t = simNowUs();
+        bool parked = idleMode.isIdle();
+        idleLoop();
+        neutralParkedUs += parked ? simNowUs() - t : 0;
+    }
+    fprintf(report, "neutral    knob on %d  parked %.1f%% of %.0f s  wakes %lu\n", position,
+        100.0*neutralParkedUs/(simNowUs() - neutralStart), (simNowUs() - neutralStart)/1e6,
+        (unsigned long)(idleMode.getWakes() - wakes));
+}
+
+void simSetup(TcasePlant &plant, const Options &options) {
+    PlantParams params;
+    params.sensorOffsetVolts = options.sensorOffset;
+    plant.setParams(params);
+    std::vector<double> detents;
+    for (int p = 0; p < 4; p++) {
+        detents.push_back(plant.travelForVolts(POSITION_VOLTS[p]));
+    }
+    plant.setDetents(detents);
+    SimConfig config;
+    config.callCostUs = options.callCostUs;
+    plant.setPositionVolts(AWD_V);
+    simBegin(&plant, config);
+    simSetSwitchOhms(SWITCH_OHMS[AWD]);
+
+    adcSampler.begin(switchModePin, motorModePin, SWITCH_OVERSAMPLE_BITS, MODE_OVERSAMPLE_BITS);
+    output.begin();
+    motor.begin();
+    selector.begin(0);
+    scheduler.addPeriodic(saveMotorModel, 1000);
+    scheduler.addPeriodic(saveShiftHistory, 100);
+    if (options.telemetry) {
+        telemetry.begin(switchModePin, motorModePin);
+        telemetry.setEnabled(true);
+        scheduler.addPeriodic(flushTelemetry, 4);
+    }
+}
+
+#ifndef PIO_UNIT_TESTING  // (test/test_sim has its own main)
+int main(int argc, char **argv) {
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = (i + 1 < argc) ? argv[i + 1] : "";
+        if (!strcmp(arg, "-n")) {
+            options.shifts = atol(value); i++;
+        } else if (!strcmp(arg, "-s")) {
+            options.seed = strtoul(value, nullptr, 10); i++;
+        } else if (!strcmp(arg, "-j")) {
+            options.jamProbability = atof(value); i++;
+        } else if (!strcmp(arg, "-c")) {
+            options.callCostUs = strtoul(value, nullptr, 10); i++;
+        } else if (!strcmp(arg, "-p")) {
+            options.runSteps = !strcmp(value, "steps") || !strcmp(value, "both");
+            options.runTrapezoid = !strcmp(value, "trapezoid") || !strcmp(value, "both");
+            i++;
+        } else if (!strcmp(arg, "-v")) {
+            options.verbose = true;
+        } else if (!strcmp(arg, "-o")) {
+            options.sensorOffset = atof(value); i++;
+        } else if (!strcmp(arg, "-i")) {
+            options.idleTrials = atol(value); i++;
+        } else if (!strcmp(arg, "-w")) {
+            options.weaken = atof(value); i++;
+        } else if (!strcmp(arg, "-C")) {
+            options.calibrate = true;
+        } else if (!strcmp(arg, "-T")) {
+            options.telemetry = true;
+            report = stderr;
+        } else {
+            fprintf(stderr, "usage: %s [-n shifts] [-s seed] [-p steps|trapezoid|both] [-j jam probability] [-c call us] [-o volts] [-w speed factor] [-i idle trials] [-C] [-v] [-T]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    TcasePlant plant(options.seed);
+    simSetup(plant, options);
+
+    if (options.calibrate) {
+        bool saved = motor.calibrate();
+        fprintf(report, "calibrate  %s\n", saved ? "saved" : "failed");
+        for (int p = 0; p < 4; p++) {
+            fprintf(report, "           position %d  learned %.3f V (noise %.1f mV p-p)  detent %.3f V\n", p,
+                readingToVolts(calibration.target(p)), calibration.noise(p)*ADC_VIN*1000/1023,
+                plant.sensorVoltsAt(plant.travelForVolts(POSITION_VOLTS[p])));
+        }
+    }
+    if (options.runSteps) {
+        runProfile(plant, PROFILE_STEPS, options);
+    }
+    if (options.runTrapezoid) {
+        runProfile(plant, PROFILE_TRAPEZOID, options);
+    }
+    if (options.idleTrials > 0) {
+        runIdle(plant, options);
+    }
+    while (eepromWriter.busy()) {
+        delay(1);
+    }
+    PositionJournal rebooted;  // What the next boot would read
+    fprintf(report, "eeprom     %lu bytes written, journal recovers position %d (motor is in %d)\n", simEepromWrites(),
+        rebooted.begin() ? rebooted.get() : -1, motor.getValidPosition());
+    if (options.telemetry) {
+        telemetry.setEnabled(false);
+        for (uint8_t i = 0; i < TELEMETRY_BUFFER_SIZE/64; i++) {  // Empty the ring first (Serial here always takes 64)
+            telemetry.flush();
+        }
+        shiftHistory.dump();
+    }
+    if (options.verbose) {
+        shiftLog.print();
+        PROFILE_PRINT();
+    }
+    return 0;
+}
+#endif
@@ -0,0 +1,40 @@
+#pragma once
+#include <Arduino.h>
+#include <stdio.h>
+#include <vector>
+#include "sim.h"
+
+// Shift simulator runs (sim_main.cpp), shared by its command line and the native test suite (test/test_sim)
+
+struct Options {
+    long shifts = 1000;
+    uint32_t seed = 1;
+    bool runSteps = true;
+    bool runTrapezoid = true;
+    double jamProbability = 0.0;
+    uint32_t callCostUs = 4;
+    bool verbose = false;
+    bool telemetry = false;
+    double sensorOffset = 0.0;
+    bool calibrate = false;
+    double weaken = 1.0;  // Motor speed multiplied by this half way through each run
+    long idleTrials = 0;
+};
+
+struct RunStats {
+    std::vector<double> shiftMs;  // Whole attemptShift, including brake release/apply
+    std::vector<double> motionMs;  // Motor first driven -> last stopped
+    std::vector<double> overshootMv;
+    long succeeded = 0;
+    long failed = 0;
+    long retried = 0;  // Shifts that needed at least one retry
+    unsigned long retries = 0;
+};
+
+extern FILE *report;  // Where runProfile()/runIdle() print their results
+
+void simSetup(TcasePlant &plant, const Options &options);  // Simulated board + firmware, once per process
+RunStats runProfile(TcasePlant &plant, byte profile, const Options &options);
+void runIdle(TcasePlant &plant, const Options &options);
+double percentile(std::vector<double> values, double p);
+double mean(const std::vector<double> &values);
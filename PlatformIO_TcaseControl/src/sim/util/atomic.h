@@ -0,0 +1,6 @@
+#pragma once
+// Native stand-in for <util/atomic.h>. Simulated interrupts only run from inside the time/pin functions in sim.cpp,
+// so a block that doesn't call them is already atomic.
+#define ATOMIC_RESTORESTATE 0
+#define ATOMIC_FORCEON 0
+#define ATOMIC_BLOCK(type) for (int atomicOnce_ = 1; atomicOnce_; atomicOnce_ = 0)
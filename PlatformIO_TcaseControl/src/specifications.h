@@ -5,6 +5,17 @@
 #define NEUTRAL 2
 #define FOURLO 3
 
+// Motor directions
+#define TOWARD_4HI -1
+#define TOWARD_4LO 1
+
+// Motor driver pins. Compile time constants so the control interrupt can use FastPin/PwmPin (fastpin.h)
+// MOTOR_PWM_PIN has to be a Timer1 output (9 = OC1A or 10 = OC1B, see motorpwm.h): Timer0 runs millis() and Timer2
+// the control interrupt. The TFT's CS/DC (main.cpp) are plain GPIO and must stay off whichever one this is
+const uint8_t MOTOR_PWM_PIN = 9;
+const uint8_t MOTOR_DIR_PIN = 7;
+const uint8_t BRAKE_RELEASE_PIN = 4;
+
 // All for NV244 transfercase
 
 // Switch resistance specs
@@ -26,20 +37,32 @@ const int SW_LO_HIGH = 5334;
 const int SW_OPEN_LOW = 19000;
 // NV144: Same as NV244 but only 4HI and AWD
 
+// Switch is read through a voltage divider with this fixed resistor to 5V
+// const int SWITCH_FIXED_RESISTOR = 4555;
+const int SWITCH_FIXED_RESISTOR = 4675;  // Resistance of fixed resistor for detecting mode select resistance in ohms
+
 // Switch debounce time (s)
-const float SW_DEBOUNCE_S = 0.25;
+constexpr float SW_DEBOUNCE_S = 0.25;
 const float SW_N_PRESS_TIME_S = 3.0;
 
+// ADC reference (AVcc). Both sensors are read against this
+constexpr float ADC_VIN = 5.0;
+
 // Mode sensor voltages (NV244)
 // Positions {0, 1, 2, 3} == 4HIGH, AWD, Neutral, 4LO
-const float LOCK_V = 4.24;      //Spec: 4.31   // Measured 4.24
-const float AWD_V = 3.35;        //Spec: 3.4;  // Measured 3.34 - 3.38
-const float N_V = 2.43;          //Spec: 2.5;  // Measured 2.38 - 2.48
-const float LO_V = 1.53;        //Spec: 1.54;  // Measured 1.49 - 1.55
-const float LOW_LIMIT = 0.50;   
-const float HIGH_LIMIT = 4.51;
-const float POSITION_TOLERANCE = 0.05;  // Stop shifting once within this distance of target voltage
-const float MOTOR_DRIFT_TOLERANCE_V = 0.2;  // Allow motor to be up to <tol> outside of ideal range when returning current motor position
+// (constexpr so that sensors.h can turn them into ADC reading thresholds at compile time)
+constexpr float LOCK_V = 4.24;      //Spec: 4.31   // Measured 4.24
+constexpr float AWD_V = 3.35;        //Spec: 3.4;  // Measured 3.34 - 3.38
+constexpr float N_V = 2.43;          //Spec: 2.5;  // Measured 2.38 - 2.48
+constexpr float LO_V = 1.53;        //Spec: 1.54;  // Measured 1.49 - 1.55
+constexpr float LOW_LIMIT = 0.50;   
+constexpr float HIGH_LIMIT = 4.51;
+constexpr float POSITION_TOLERANCE = 0.05;  // Stop shifting once within this distance of target voltage
+constexpr float MOTOR_DRIFT_TOLERANCE_V = 0.2;  // Allow motor to be up to <tol> outside of ideal range when returning current motor position
+// Calibration (see calibration.h, 'c' command): learned positions can be up to this far from the values above
+constexpr float CALIBRATION_MAX_DRIFT_V = 0.3;
+const byte CALIBRATION_SAMPLES = 64;  // Mode sensor samples taken at each position (every CALIBRATION_SAMPLE_MS)
+const byte CALIBRATION_SAMPLE_MS = 5;
 // NV244 manual:
 // const float LOCK_LOW = 4.26;
 // const float LOCK_HIGH = 4.36;
@@ -59,6 +82,12 @@ const byte MAX_SINGLE_SHIFT_ATTEMPTS = 2;  // Max times to try shifting to desir
 const byte MAX_RETURN_SHIFT_ATTEMPTS = 3;  // How many times to try getting back to the last valid state after a failed shift
 const float RETRY_TIME_S = 2.0;  // Time to wait before retrying a shift
 
+// Stall detection (see control.h). A shift is stopped early if the motor isn't moving as fast as the PWM applied should make it
+constexpr float STALL_MIN_VELOCITY_V_S = 0.3;  // Slowest expected movement at full duty (255), scaled down with the duty applied
+const unsigned int STALL_TIME_MS = 200;  // Too slow for this long = stalled
+const unsigned int STALL_GRACE_MS = 150;  // Spin up time ignored after starting (or reversing)
+const unsigned int STALL_RETRY_MS = 250;  // Wait before retrying a stalled shift, doubled for each further attempt
+
 // From Service Manual:
 // "Current attempt limit values are 25 transitions in 30 seconds and default mode
 // values are 3 transitions every 15 seconds for 5 minutes."
@@ -72,8 +101,12 @@ const float RETRY_TIME_S = 2.0;  // Time to wait before retrying a shift
 // I think we will stick to some more simple procedures
 
 // PWM parameters
-const int PWM_FREQUENCY = 490; // FCM uses 100Hz PWM Frequency but Arduino uses 490Hz by default (not worth changing)
-const float PWM_ACCELERATION = 2.0; // Not specified in manual (only says "specified rate"):
+// Motor PWM runs on Timer1 (see motorpwm.h), which works out the prescaler and TOP for the frequency and checks the
+// counts per period cover the duty resolution
+const uint16_t MOTOR_PWM_FREQUENCY_HZ = 1000;  // FCM uses 100Hz PWM Frequency. ~1kHz is what this was tuned with (Timer0's 976Hz)
+const bool MOTOR_PWM_PHASE_CORRECT = true;  // Phase correct (pulse centred in the period) or fast PWM (twice the counts per period)
+const byte MOTOR_DUTY_FRACTION_BITS = 2;  // Motor duty resolution is 8 + this many bits (fractions of a PWM_MAX_POWER count)
+constexpr float PWM_ACCELERATION = 2.0; // Not specified in manual (only says "specified rate"):
                            // increase of duty cycle per second (i.e. duty == 1.0 is MAX so 2.0 means 0 -> MAX in 0.5s)
 
 // Not specified in manual (says "specified rate based upon difference between desired position and current position")
@@ -82,8 +115,60 @@ const float PWM_ACCELERATION = 2.0; // Not specified in manual (only says "speci
 byte PWM_MAX_POWER = 180; // Max power is 255. 180 seems to work fine for normal use. Power gets redefined to 255 if in manual mode
 const byte PWM_MIN_POWER = 50; // Not specified in manual - probably need some minimum power to actually make motor move
 
+// Learned motor model (see feedforward.h): speed is spread over deadband + FF_CREEP_MARGIN -> PWM_MAX_POWER
+const byte FF_CREEP_MARGIN = 12;  // PWM counts above the learned deadband for the slowest speed. Unlearned = PWM_MIN_POWER
+const byte FF_STEADY_TICKS = 20;  // Duty unchanged for this many control ticks before a sample is taken (motor has caught up)
+const unsigned int FF_MIN_SAMPLES = 50;  // Fewer samples than this in a shift aren't fitted
+const byte FF_MIN_PWM_SPREAD = 8;  // Duty standard deviation (counts) needed to fit the deadband, below it only the gain is updated
+const byte FF_BLEND_SHIFT = 2;  // Each new fit moves the model 1/2^n of the way
+const byte FF_BASELINE_UPDATES = 8;  // Gain after this many fits is what "weak" is measured against
+constexpr float FF_WEAK_GAIN_FRACTION = 0.7;  // Gain below this fraction of the baseline = motor getting weak
+
+// Motor control loop (runs from a Timer2 interrupt, see control.h)
+const unsigned int CONTROL_RATE_HZ = 500;  // 489 - 1000Hz. Speed/direction updated this many times per second
+
+// Shift motion profile (see profile.h). Speed 1.0 == PWM_MAX_POWER
+// Trapezoid: ramp up at PROFILE_ACCEL, cruise at full speed, then slow down so that speed^2 is proportional to
+// the distance left (i.e. constant deceleration), reaching zero at the target
+#define PROFILE_STEPS 0      // Original 5 step speed table (1.0/0.5/0.3/0.1/0.01 by distance) with PWM_ACCELERATION
+#define PROFILE_TRAPEZOID 1
+const byte MOTION_PROFILE = PROFILE_TRAPEZOID;
+constexpr float PROFILE_ACCEL_TOWARD_4HI = 2.0;  // Speed increase per second
+constexpr float PROFILE_ACCEL_TOWARD_4LO = 2.0;
+constexpr float PROFILE_STOP_DISTANCE_TOWARD_4HI_V = 0.5;  // Distance (V) it takes to slow down from full speed
+constexpr float PROFILE_STOP_DISTANCE_TOWARD_4LO_V = 0.5;
+
+// Background ADC oversampling (see adc.h): a reading averages 4^n samples of its input, for n more bits. 0 - 2 is a
+// moving window (n = 2 is ~2ms behind), 3 - 4 a block decimator (~18ms / ~71ms behind)
+const uint8_t SWITCH_OVERSAMPLE_BITS = 3;  // 0 - 4. Latency doesn't matter much (debounced over SW_DEBOUNCE_S)
+const uint8_t MODE_OVERSAMPLE_BITS = 2;  // 0 - 2. Used for the stop decision at the end of a shift, so kept fast
+constexpr unsigned long ADC_MAX_GROUP_DELAY_US = SW_DEBOUNCE_S*1000000/3;  // Readings are never older than this on average
+
+// Mode sensor position/velocity estimator (see estimator.h)
+const uint8_t ESTIMATOR_ALPHA_SHIFT = 2;  // Position correction gain = 1/2^n
+const uint8_t ESTIMATOR_BETA_SHIFT = 5;   // Velocity correction gain = 1/2^n
+const unsigned int ESTIMATOR_LOOKAHEAD_MS = 20;  // Slow down as if already this far along (covers sensor averaging + motor lag). 0 to disable
+
 // Shift Brake Release time
-const byte BRAKE_RELEASE_TIME_S = 1;  // should be between 2 - 5 seconds before and after
+const byte BRAKE_RELEASE_TIME_S = 1;  // should be between 2 - 5 seconds before and after  // Now the longest wait, see below
+// The brake waits end early once these are met (see Motor::runShift)
+const unsigned int BRAKE_RELEASE_MIN_MS = 250;  // Not in manual: never drive sooner than this after releasing the brake
+const unsigned int BRAKE_APPLY_MIN_MS = 100;  // Motor off for at least this long before the brake goes back on
+const unsigned int BRAKE_STEADY_MS = 100;  // Mode sensor in range and not moving for this long
+constexpr float BRAKE_STEADY_BAND_V = 0.02;  // "Not moving" = filtered reading stays within this of where it started
+
+// Parked idle (see idle.h): after this long with nothing changing, sleep between low rate switch samples
+const unsigned int IDLE_QUIET_S = 30;
+const unsigned int IDLE_SAMPLE_MS = 50;  // Switch sample period while parked (wake latency is up to this + a few ms)
 
-// Memory address to store last valid position in (Rated for 100,000 re-writes)
-const byte EEPROM_POSITION_ADDRESS = 0;
+// EEPROM (1kB, each byte rated for 100,000 re-writes)
+// Last valid position is journalled (see journal.h): each change goes in the next of EEPROM_JOURNAL_SLOTS 4 byte slots
+const uint16_t EEPROM_JOURNAL_START = 0;
+const uint8_t EEPROM_JOURNAL_SLOTS = 128;  // 512 bytes
+const byte EEPROM_POSITION_ADDRESS = 0;  // Where the position was kept before the journal (only read if the journal is empty)
+// Shift history and per from -> to pair counters (see history.h)
+const uint16_t EEPROM_HISTORY_START = 512;
+const uint8_t EEPROM_HISTORY_SLOTS = 24;  // 12 bytes each
+const uint16_t EEPROM_COUNTERS_START = 800;  // 16 pairs (from == to unused) of 8 bytes
+const uint16_t EEPROM_CALIBRATION_START = 928;  // Learned mode sensor positions (see calibration.h), 14 bytes
+const uint16_t EEPROM_MOTOR_MODEL_START = 942;  // Learned motor model (see feedforward.h), 13 bytes. 955 -> 1023 is free
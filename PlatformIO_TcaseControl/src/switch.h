@@ -2,6 +2,10 @@
 #include <Arduino.h>
 #include "output.h"
 #include "specifications.h"
+#include "scheduler.h"
+#include "adc.h"
+#include "profiler.h"
+#include "sensors.h"
 
 // #define DEBUG
 
@@ -19,94 +23,138 @@ const int messageBufferLength = maxChars*4;
 char messageBuffer[messageBufferLength+1];
 
 
+// Selector switch state machine
+// checkState() takes one sample (from adcSampler, so it never waits on the ADC) and moves the state machine on:
+//   SW_IDLE -> SW_CANDIDATE  a reading other than the confirmed one
+//   SW_CANDIDATE -> SW_IDLE  confirmed once held for SW_DEBOUNCE_S (or dropped if the reading goes back)
+//   -> SW_N_PRESSED          Neutral was confirmed (it's a push, the knob springs back)
+//   SW_N_PRESSED -> SW_N_LONG  held for SW_N_PRESS_TIME_S: toggle in/out of Neutral
+//   SW_N_PRESSED -> SW_IDLE  released early: a tap (shows the cat, nothing else)
+//   SW_N_LONG -> SW_IDLE     released: selection is Neutral, or whatever the knob is on if toggled out
+// Changes are also queued as SwitchEvents for whoever wants them. Each reader keeps its own tail, so getSelection()
+// (which shows the cat for taps) doesn't take events away from nextEvent().
+// It's all called from the pollSwitch scheduler task (main.cpp) and from getSelection(), so nothing ever blocks on
+// the knob.
+
+constexpr unsigned long SW_DEBOUNCE_MS = SW_DEBOUNCE_S*1000;
+const unsigned long SW_N_PRESS_MS = SW_N_PRESS_TIME_S*1000;
+const unsigned int SW_CAT_MS = 2000;  // Cat shown for a Neutral tap
+const uint8_t SWITCH_EVENT_QUEUE_SIZE = 4;  // Power of 2
+
+enum SwitchState : uint8_t {
+    SW_IDLE,
+    SW_CANDIDATE,
+    SW_N_PRESSED,
+    SW_N_LONG
+};
+
+enum SwitchEventType : uint8_t {
+    SWITCH_POSITION_CHANGED,  // position = new selection
+    SWITCH_NEUTRAL_TOGGLED,  // position = NEUTRAL if toggled in, -1 if toggled out
+    SWITCH_NEUTRAL_TAPPED
+};
+
+struct SwitchEvent {
+    SwitchEventType type;
+    int8_t position;
+};
+
 class SelectorSwitch {
     private: 
         uint8_t modeSelectPin;
         int lastValidState = AWD;  // Defaults to this in case switch isn't connected
         bool inNeutral = false;
-        unsigned long timeEnteredState;
-        unsigned long timeLastChecked;
+        bool neutralReset = false;  // Neutral presses are only timed (see setNeutralReset)
+        SwitchState state = SW_IDLE;
+        int8_t confirmedState = -3;  // Last debounced reading (-3 = none yet)
+        int8_t candidateState = -3;  // Most recent reading, confirmed once it has been stable for SW_DEBOUNCE_S
+        unsigned long timeEnteredState;  // Of candidateState
+        unsigned long timeNeutralPressed;
+        SwitchEvent events[SWITCH_EVENT_QUEUE_SIZE];
+        uint8_t eventHead = 0;
+        uint8_t eventTail = 0;  // nextEvent()'s
+        uint8_t catTail = 0;  // getSelection()'s
         OtherOutputs* output;  // Pointer so that it points to the same object everywhere
-        const int FIXED_RESISTOR;
 
         /**
-         * Read position of selector switch
+         * Read position of selector switch (fixed point reading, see sensors.h)
          */ 
-        int readSwitchPositionOhms() {
-            // Returns resistance of switch
-            float Vin = 5.0;
-            analogRead(modeSelectPin); // Throw away reading to make sure the next ones aren't affected by previous readings
-            ///// Basic Averaging /////////////////
-            float Vout = 0.0;
-            for (int i=0; i<10; i++) {
-                Vout += Vin*analogRead(modeSelectPin)/1023;  //~100us per read
-            } 
-            Vout = Vout/10.0;  // Because of averaging
-            ///////////////////////////////////////
-            ////// Exponential Averaging /////////// (less prone to spikes)
-            // int V = analogRead(modeSelectPin);
-            // const float alpha = 0.1;  // Lower more stable but slower to vary
-            // for (int i=0; i<10; i++) {
-            //     V = (alpha*analogRead(modeSelectPin)+(1-alpha)*V);
-            // }
-            // float Vout = V/1023.0;
-            /////////////////////////////////////////
-            int resistance = round(FIXED_RESISTOR * (Vin - Vout) / Vout); 
-            output->setSwitchResistance(resistance); 
-            return resistance;
-        }
-
-        void neutralPressed() {
-            int currentState;
-            output->getMainMessage(messageBuffer, messageBufferLength);
-            output->setMainMessage(F("Neutral Pressed"));
-            DEBUG_PRINTLN(F("N Pressed"));
-            while (millis() - timeEnteredState < SW_N_PRESS_TIME_S*1000 && getSwitchPosition() == NEUTRAL) {
-                delay(10);
+        reading_t readSwitchReading() {
+            // Averaged in the background by adcSampler. Resistance is only worked out if it gets displayed
+            PROFILE_SCOPE(PROF_ADC_READ);
+            reading_t reading = adcSampler.getReading(modeSelectPin);
+            output->setSwitchReading(reading); 
+            return reading;
+        }
+
+        void pushEvent(SwitchEventType type, int8_t position) {
+            // Overwrites the oldest if the queue is full (the selection itself is always in lastValidState)
+            events[eventHead & (SWITCH_EVENT_QUEUE_SIZE - 1)] = {type, position};
+            eventHead++;
+        }
+
+        bool settled(int sample, unsigned long now) {
+            // Track the candidate, true once it has been held for SW_DEBOUNCE_S
+            if (sample != candidateState) {
+                candidateState = sample;
+                timeEnteredState = now;
             }
-            if (millis() - timeEnteredState > SW_N_PRESS_TIME_S*1000) {
-                DEBUG_PRINTLN(F("N Pressed longer than 0.25s"));
-                toggleNeutral();
-                while (getSwitchPosition() == NEUTRAL) {
-                    delay(10);
-                    currentState = getSwitchPosition();
-                }
+            return now - timeEnteredState >= SW_DEBOUNCE_MS;
+        }
+
+        void select(int position) {
+            if (position != lastValidState) {
+                lastValidState = position;
+                DEBUG_PRINT(F("Switch: selection ")); DEBUG_PRINTLN(lastValidState);
+                output->setSwitchPos(lastValidState);
+                pushEvent(SWITCH_POSITION_CHANGED, lastValidState);
+            }
+        }
+
+        void confirm() {
+            // candidateState has been stable for SW_DEBOUNCE_S
+            confirmedState = candidateState;
+            if (confirmedState == NEUTRAL) {
+                timeNeutralPressed = timeEnteredState;
+                state = SW_N_PRESSED;
+                output->getMainMessage(messageBuffer, messageBufferLength);
+                output->setMainMessage(F("Neutral Pressed"));
+                DEBUG_PRINTLN(F("N Pressed"));
+                return;
+            }
+            state = SW_IDLE;
+            if (!inNeutral && isValid(confirmedState)) {
+                select(confirmedState);
+            }
+        }
+
+        void neutralReleased() {
+            // Knob has left Neutral (debounced). candidateState is where it went
+            confirmedState = candidateState;
+            if (state == SW_N_LONG) {
                 if (inNeutral) {
-                    lastValidState = NEUTRAL;
+                    select(NEUTRAL);
                 } else {
-                    if (isValid(currentState)) {
-                        lastValidState = currentState;
-                    } else {
-                        lastValidState = AWD;
-                    }
+                    select(isValid(confirmedState) ? confirmedState : AWD);
+                }
+            } else {
+                if (!neutralReset) {
+                    DEBUG_PRINTLN(F("N tapped"));
+                    pushEvent(SWITCH_NEUTRAL_TAPPED, -1);
+                }
+                if (!inNeutral && isValid(confirmedState)) {
+                    select(confirmedState);
                 }
-                DEBUG_PRINTLN(F("Setting output lastValidState:"));
-                DEBUG_PRINTLN(lastValidState);
-                output->setSwitchPos(lastValidState);
-            } else {  // Neutral only pressed for short time, show easter egg but do nothing to switch position or lastValidState
-                output->showCat(2000);
             }
-            DEBUG_PRINTLN(F("setting back to previous message"));
             output->setMainMessage(messageBuffer);
-        }
-
-        void toggleNeutral() {
-            inNeutral = !inNeutral;
-            if (inNeutral) {
-                DEBUG_PRINTLN(F("Set output to N"));
-                output->setSwitchPos(NEUTRAL);
-            } 
-            DEBUG_PRINTLN(F("setting message neutral toggled"));
-            output->setMainMessage(F("Neutral Toggled"));  // TODO: Replace with something that flashes a big N or something like that
-            delay(100);
+            state = SW_IDLE;
         }
 
     public:
-        SelectorSwitch(int analogInput, OtherOutputs* out, int FIXED_RESISTOR) 
+        SelectorSwitch(int analogInput, OtherOutputs* out) 
             : modeSelectPin(analogInput)
             , lastValidState(AWD)
             , output(out)
-            , FIXED_RESISTOR(FIXED_RESISTOR)
             {
         }
 
@@ -116,29 +164,21 @@ class SelectorSwitch {
                 lastValidState = NEUTRAL;
             }
             pinMode(modeSelectPin, INPUT);
-            getSelection();
+            unsigned long start = millis();
+            do {  // Sample until the first reading is confirmed so lastValidState is correct from the start
+                checkState();
+                scheduler.wait(10);
+            } while ((confirmedState == -3 || state == SW_CANDIDATE) && millis() - start < 4*SW_DEBOUNCE_MS);
+            eventTail = catTail = eventHead;  // Nothing has changed as far as anyone else is concerned
             output->setSwitchPos(lastValidState);
         }
 
         int getSwitchPosition() {
             // Returns position as value from 0 -> 3 or -1 if invalid (or -2 if invalid and out of range)
-            int ohms = readSwitchPositionOhms();
-            int position;
-            if (ohms < SW_SHORTED_HIGH || ohms > SW_OPEN_LOW) {
-                position = -2;  // Bad position and out of range
-            } else if (ohms > SW_LOCK_LOW && ohms < SW_LOCK_HIGH) {
-                position = FOURHI;
-            } else if (ohms > SW_AWD_LOW && ohms < SW_AWD_HIGH) {
-                position = AWD;
-            // } else if (ohms > min(SW_N_AWD_LOW, min(SW_N_LOCK_LOW, SW_N_LO_LOW))*0.9 && ohms < max(SW_N_AWD_HIGH, max(SW_N_LOCK_HIGH, SW_N_LO_HIGH))*1.1) {  // 4LO_N reads 228ohm (instead of 226 which should be the max...)
-            } else if (ohms > SW_N_LOW && ohms < SW_N_HIGH) {  // 4LO_N reads 228ohm (instead of 226 which should be the max...)
-                position = NEUTRAL;
-            } else if (ohms > SW_LO_LOW && ohms < SW_LO_HIGH) {
-                position = FOURLO;
-            } else {
-                position = -1; // Bad position but in range
-            }
-            return position;
+            // (Table is built from specifications.h at compile time, see POSITION_LUT)
+            reading_t reading = readSwitchReading();
+            PROFILE_SCOPE(PROF_CLASSIFY);
+            return lookupSwitchPosition(reading);
         }
 
         void setLastValidState(byte state) {
@@ -146,36 +186,113 @@ class SelectorSwitch {
         }
 
         void readOnly(){
-            readSwitchPositionOhms();
+            readSwitchReading();
         }
 
         int getSelection() {
-            // Return current selection (last validState after calling check)
+            // Return current selection after taking a sample, and show the cat for any Neutral tap since the last call
             checkState();
+            SwitchEvent event;
+            while (nextEvent(event, catTail)) {
+                if (event.type == SWITCH_NEUTRAL_TAPPED) {
+                    output->showCat(SW_CAT_MS);  // Easter egg, doesn't change anything
+                }
+            }
+            return lastValidState;
+        }
+
+        int getLastValidState() {
+            // Current selection without reading the switch
             return lastValidState;
         }
 
+        int8_t getConfirmedState() {
+            // Where the knob physically is (last debounced reading, -1/-2 invalid, -3 none yet). Differs from the
+            // selection in Neutral, which is a press: the knob springs back to whatever detent it was pushed from
+            return confirmedState;
+        }
+
+        bool isSettled() {
+            // Nothing being debounced or held
+            return state == SW_IDLE;
+        }
+
+        bool nextEvent(SwitchEvent &event, uint8_t &tail) {
+            // Oldest event this reader (tail) hasn't had, false if there aren't any. A reader that's fallen more than
+            // SWITCH_EVENT_QUEUE_SIZE behind skips the ones that have been overwritten
+            if ((uint8_t)(eventHead - tail) > SWITCH_EVENT_QUEUE_SIZE) {
+                tail = eventHead - SWITCH_EVENT_QUEUE_SIZE;
+            }
+            if (eventHead == tail) {
+                return false;
+            }
+            event = events[tail & (SWITCH_EVENT_QUEUE_SIZE - 1)];
+            tail++;
+            return true;
+        }
+
+        bool nextEvent(SwitchEvent &event) {
+            // Oldest queued event, false if there aren't any (getSelection() reading taps doesn't use them up)
+            return nextEvent(event, eventTail);
+        }
+
+        void setNeutralReset(bool on) {
+            // While on, holding Neutral doesn't toggle it or count as a tap, it's only timed (neutralHeldMs) for the
+            // reset in main.cpp
+            neutralReset = on;
+        }
+
+        unsigned long neutralHeldMs() {
+            // How long Neutral has been held (0 if it isn't)
+            if (state != SW_N_PRESSED && state != SW_N_LONG) {
+                return 0;
+            }
+            return max(millis() - timeNeutralPressed, 1UL);
+        }
+
         void checkState() {
-            // Check the switch position. If new wait until we know switch isn't mid change
-            int newState = getSwitchPosition();
-            timeEnteredState = millis();
-            if (newState == NEUTRAL) {
-                // if current selection is Neutral check whether entering or leaving and handle appropriately
-                neutralPressed();  
-            } else if (!inNeutral) {
-                if (newState != lastValidState && isValid(newState)) {
-                    while (getSwitchPosition() == newState && millis() - timeEnteredState < SW_DEBOUNCE_S*1000) {
-                        delay(10);
+            // Take one reading of the switch and move the state machine on (see the top of this file). Never blocks
+            int sample = getSwitchPosition();
+            unsigned long now = millis();
+            switch (state) {
+                case SW_IDLE:
+                    if (sample != confirmedState) {
+                        candidateState = sample;
+                        timeEnteredState = now;
+                        state = SW_CANDIDATE;
                     }
-                    if (millis() - timeEnteredState > SW_DEBOUNCE_S*1000) { 
-                        lastValidState = newState;
-                        DEBUG_PRINTLN(F("Not in Neutral, setting LastValidState"));
-                        output->setSwitchPos(lastValidState);
-                    } else {
-                        // Switch is still changing, so don't update lastValidState, wait until this is called again
+                    break;
+                case SW_CANDIDATE:
+                    if (sample == confirmedState) {
+                        state = SW_IDLE;  // Just noise
+                    } else if (settled(sample, now)) {
+                        confirm();
                     }
-                }
+                    break;
+                case SW_N_PRESSED:
+                    if (sample == NEUTRAL) {
+                        candidateState = NEUTRAL;
+                        if (!neutralReset && now - timeNeutralPressed >= SW_N_PRESS_MS) {
+                            DEBUG_PRINTLN(F("N held, toggling"));
+                            inNeutral = !inNeutral;
+                            if (inNeutral) {
+                                output->setSwitchPos(NEUTRAL);
+                            }
+                            output->setMainMessage(F("Neutral Toggled"));  // TODO: Replace with something that flashes a big N or something like that
+                            pushEvent(SWITCH_NEUTRAL_TOGGLED, inNeutral ? NEUTRAL : -1);
+                            state = SW_N_LONG;
+                        }
+                    } else if (settled(sample, now)) {
+                        neutralReleased();
+                    }
+                    break;
+                case SW_N_LONG:
+                    if (sample == NEUTRAL) {
+                        candidateState = NEUTRAL;
+                    } else if (settled(sample, now)) {
+                        neutralReleased();
+                    }
+                    break;
             }
-            timeLastChecked = millis();
         }
 };
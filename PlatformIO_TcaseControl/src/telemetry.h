@@ -0,0 +1,136 @@
+#pragma once
+#include <Arduino.h>
+#include "hal.h"
+#include "adc.h"
+#include "cobs.h"
+#include "shiftlog.h"
+
+// Binary telemetry over Serial
+// Framed packets (see cobs.h) go into a RAM ring buffer and a scheduler task hands them to Serial only as fast as
+// its TX buffer has room, so writing telemetry never blocks the loop or the control interrupt. If the ring is full
+// the packet is dropped (and counted) rather than waiting.
+// Samples are taken by the control interrupt every TELEMETRY_DIVIDER ticks; toggled with the 't' command (main.cpp).
+// tools/telemetry_decode.cpp turns a capture into CSV.
+
+const uint8_t TELEMETRY_BUFFER_BITS = 7;
+const uint8_t TELEMETRY_BUFFER_SIZE = 1 << TELEMETRY_BUFFER_BITS;
+const uint8_t TELEMETRY_DIVIDER = 2;  // 500Hz control rate / 2 = 250 samples/s = 4kB/s (115200 baud is ~11.5kB/s)
+
+class Telemetry {
+    private:
+        uint8_t buffer[TELEMETRY_BUFFER_SIZE];
+        volatile uint8_t head = 0;  // Written with interrupts off (packets come from the interrupt and the loop)
+        volatile uint8_t tail = 0;  // Only written by flush()
+        volatile bool enabled = false;
+        volatile bool brake = true;
+        volatile uint16_t dropped = 0;
+        uint8_t switchPin = 0;
+        uint8_t modePin = 0;
+        uint8_t divider = 0;
+
+        uint8_t makeFrame(const uint8_t *payload, uint8_t length, uint8_t *frame) {
+            uint8_t data[TELEMETRY_MAX_PAYLOAD + 1];
+            memcpy(data, payload, length);
+            data[length] = telemetryChecksum(payload, length);
+            uint8_t frameLength = cobsEncode(data, length + 1, frame);
+            frame[frameLength++] = 0;
+            return frameLength;
+        }
+
+        void pushFromISR(const uint8_t *payload, uint8_t length) {
+            uint8_t frame[COBS_MAX_FRAME];
+            uint8_t frameLength = makeFrame(payload, length, frame);
+            uint8_t space = TELEMETRY_BUFFER_SIZE - 1 - (uint8_t)(head - tail);
+            if (frameLength > space) {
+                dropped++;
+                return;
+            }
+            uint8_t h = head;
+            for (uint8_t i = 0; i < frameLength; i++) {
+                buffer[h & (TELEMETRY_BUFFER_SIZE - 1)] = frame[i];
+                h++;
+            }
+            head = h;
+        }
+
+    public:
+        void begin(uint8_t switchSensorPin, uint8_t modeSensorPin) {
+            switchPin = switchSensorPin;
+            modePin = modeSensorPin;
+        }
+
+        void setEnabled(bool on) {
+            enabled = on;
+        }
+
+        bool isEnabled() {
+            return enabled;
+        }
+
+        uint16_t getDropped() {
+            uint16_t d;
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                d = dropped;
+            }
+            return d;
+        }
+
+        void setBrake(bool on) {
+            brake = on;
+        }
+
+        void sampleFromISR(int8_t direction, uint8_t pwm) {
+            // Control interrupt only
+            if (!enabled || ++divider < TELEMETRY_DIVIDER) {
+                return;
+            }
+            divider = 0;
+            TelemetrySample sample;
+            sample.type = TELEMETRY_SAMPLE;
+            sample.timeUs = micros();
+            sample.modeCount = adcSampler.getLatest(modePin);
+            sample.switchCount = adcSampler.getLatest(switchPin);
+            sample.pwm = pwm;
+            sample.direction = direction;
+            sample.brake = brake;
+            sample.phase = shiftLog.getPhase();
+            pushFromISR((const uint8_t *)&sample, sizeof(sample));
+        }
+
+        void event(uint8_t kind, int8_t from, int8_t to, uint8_t flags) {
+            if (!enabled) {
+                return;
+            }
+            TelemetryEvent packet;
+            packet.type = TELEMETRY_EVENT;
+            packet.timeUs = micros();
+            packet.event = kind;
+            packet.from = from;
+            packet.to = to;
+            packet.flags = flags;
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                pushFromISR((const uint8_t *)&packet, sizeof(packet));
+            }
+        }
+
+        void sendNow(const uint8_t *payload, uint8_t length) {
+            // Frame a packet and write it straight to Serial, waiting for room if need be. Only for replies to
+            // Serial commands (like the 'h' dump), never from anything time critical
+            uint8_t frame[COBS_MAX_FRAME];
+            uint8_t frameLength = makeFrame(payload, length, frame);
+            Serial.write(frame, frameLength);
+        }
+
+        void flush() {
+            // Scheduler task: send what Serial can take without blocking
+            int room = Serial.availableForWrite();
+            uint8_t t = tail;
+            while (room-- > 0 && t != head) {
+                Serial.write(buffer[t & (TELEMETRY_BUFFER_SIZE - 1)]);
+                t++;
+            }
+            tail = t;
+        }
+};
+
+Telemetry telemetry;
@@ -0,0 +1,57 @@
+// Shift simulator as a regression check: pio test -e native
+// Fixed seed batches of shifts through the simulated transfer case (src/sim/), checking the success rate and shift
+// time bounds. The bounds have some room over what the current code does, so they catch a real regression rather
+// than noise from an unrelated change.
+#include <unity.h>
+#include "simrun.h"
+
+const long TEST_SHIFTS = 200;
+// PROFILE_STEPS/PROFILE_TRAPEZOID: specifications.h defines the tunable globals, so only the sim sources include it
+const byte STEPS = 0;
+const byte TRAPEZOID = 1;
+
+TcasePlant plant(1);
+Options options;
+
+void setUp() {
+    options = Options();
+    options.shifts = TEST_SHIFTS;
+}
+
+void tearDown() {
+}
+
+void test_trapezoid_shifts() {
+    RunStats stats = runProfile(plant, TRAPEZOID, options);
+    TEST_ASSERT_EQUAL(0, stats.failed);
+    TEST_ASSERT_EQUAL(0, stats.retried);
+    TEST_ASSERT_LESS_THAN(1500.0, mean(stats.shiftMs));
+    TEST_ASSERT_LESS_THAN(2000.0, percentile(stats.shiftMs, 1.0));
+    TEST_ASSERT_LESS_THAN(10.0, percentile(stats.overshootMv, 1.0));
+}
+
+void test_steps_shifts() {
+    RunStats stats = runProfile(plant, STEPS, options);
+    TEST_ASSERT_EQUAL(0, stats.failed);
+    TEST_ASSERT_EQUAL(0, stats.retried);
+    TEST_ASSERT_LESS_THAN(2100.0, mean(stats.shiftMs));
+    TEST_ASSERT_LESS_THAN(2600.0, percentile(stats.shiftMs, 1.0));
+    TEST_ASSERT_LESS_THAN(10.0, percentile(stats.overshootMv, 1.0));
+}
+
+void test_jammed_shifts() {
+    // 1 in 10 shifts hits a jam that takes up to 3s of pushing to clear: most still get there, with retries
+    options.jamProbability = 0.1;
+    RunStats stats = runProfile(plant, TRAPEZOID, options);
+    TEST_ASSERT_GREATER_OR_EQUAL(TEST_SHIFTS*85/100, stats.succeeded);
+    TEST_ASSERT_TRUE(stats.retries > 0);
+}
+
+int main() {
+    simSetup(plant, options);
+    UNITY_BEGIN();
+    RUN_TEST(test_trapezoid_shifts);
+    RUN_TEST(test_steps_shifts);
+    RUN_TEST(test_jammed_shifts);
+    return UNITY_END();
+}
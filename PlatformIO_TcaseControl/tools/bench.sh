@@ -0,0 +1,72 @@
+#!/bin/sh
+# Build env:bench and run it in simavr, then report flash/RAM use.
+#
+#   tools/bench.sh                 # print results
+#   tools/bench.sh -o base.csv     # also save the cycle counts
+#   tools/bench.sh -c base.csv     # print the change from a saved run
+#
+# Needs PlatformIO and simavr (run_avr) on the PATH. avr-nm/avr-size come with PlatformIO's toolchain-atmelavr.
+# The reference run belongs in bench/baseline.csv (tools/bench.sh -o bench/baseline.csv), which hasn't been
+# recorded yet: nothing has been built for the AVR so far.
+set -e
+cd "$(dirname "$0")/.."
+
+SAVE=""
+COMPARE=""
+while getopts "o:c:" opt; do
+    case $opt in
+        o) SAVE=$OPTARG ;;
+        c) COMPARE=$OPTARG ;;
+        *) echo "usage: $0 [-o save.csv] [-c compare.csv]"; exit 1 ;;
+    esac
+done
+
+TOOLCHAIN="${PLATFORMIO_CORE_DIR:-$HOME/.platformio}/packages/toolchain-atmelavr/bin"
+[ -d "$TOOLCHAIN" ] && PATH="$TOOLCHAIN:$PATH"
+SIMAVR=$(command -v simavr || command -v run_avr || true)
+
+# Stop before building rather than part way through with a half written CSV
+for tool in pio "$SIMAVR"; do
+    if [ -z "$tool" ] || ! command -v "$tool" > /dev/null; then
+        echo "bench.sh: needs pio and simavr (or run_avr) on the PATH" >&2
+        exit 1
+    fi
+done
+
+pio run -e bench -e uno > /dev/null
+[ -d "$TOOLCHAIN" ] || command -v avr-size > /dev/null || { echo "bench.sh: no avr-size/avr-nm (toolchain-atmelavr)" >&2; exit 1; }
+ELF=.pio/build/bench/firmware.elf
+OUT=$(mktemp)
+trap 'rm -f "$OUT"' EXIT
+
+# simavr prints the UART output and quits when the benchmark sleeps with interrupts off
+timeout 300 "$SIMAVR" -m atmega328p -f 16000000 "$ELF" 2>&1 | tr -d '\r' | sed 's/\x1b\[[0-9;]*m//g' \
+    | sed -n '/BENCH START/,/BENCH END/p' | grep -v "BENCH" > "$OUT" || true
+[ -s "$OUT" ] || { echo "bench.sh: no results from simavr (did the benchmark print BENCH START/END?)" >&2; exit 1; }
+
+echo "== Cycles per call (16MHz ATmega328, simavr)"
+if [ -n "$COMPARE" ]; then
+    awk -F, 'NR == FNR { base[$1] = $3; next }
+        $1 in base && base[$1] > 0 { printf "%-45s %8s %8s  %+6.1f%%\n", $1, base[$1], $3, 100.0*($3 - base[$1])/base[$1]; next }
+        { printf "%-45s %8s %8s\n", $1, "-", $3 }' "$COMPARE" "$OUT"
+else
+    column -t -s, "$OUT"
+fi
+[ -n "$SAVE" ] && cp "$OUT" "$SAVE"
+
+echo
+echo "== Firmware size (env:uno)"
+avr-size -C --mcu=atmega328p .pio/build/uno/firmware.elf | grep -E "Program|Data"
+# Whatever .data/.bss leave is all the stack has (deepest is a display redraw inside a shift wait, plus the ISRs)
+avr-size -C --mcu=atmega328p .pio/build/uno/firmware.elf | awk '/^Data:/ { left = 2048 - $2;
+    printf "Stack headroom: %d bytes%s\n", left, (left < 512) ? "  ** WARNING: under 512 **" : "" }'
+
+echo
+echo "== Largest functions (env:uno, flash bytes)"
+avr-nm -C --size-sort -S -t d .pio/build/uno/firmware.elf | grep -i " [tTwW] " | tail -20 \
+    | awk '{ size = $2 + 0; $1 = ""; $2 = ""; $3 = ""; printf "%6d %s\n", size, $0 }'
+
+echo
+echo "== RAM (env:uno, .data/.bss objects over 16 bytes)"
+avr-nm -C --size-sort -S -t d .pio/build/uno/firmware.elf | grep -i " [bBdD] " \
+    | awk '$2 + 0 > 16 { size = $2 + 0; $1 = ""; $2 = ""; $3 = ""; printf "%6d %s\n", size, $0 }'
@@ -0,0 +1,114 @@
+// Host side check of the sensor classification in src/sensors.h
+//
+// Builds the same constexpr tables as the firmware and compares them with the original float volts/ohms logic
+// (copied from Motor::getPosition and SelectorSwitch::getSwitchPosition before they were converted):
+//   - every entry of POSITION_LUT (one per 10 bit ADC count)
+//   - classifyMotorReading/classifySwitchReading for every possible 16 bit reading
+// Prints the table as ranges of counts and returns non zero if anything differs.
+//
+// Build and run from PlatformIO_TcaseControl:
+//   g++ -std=c++11 -I src tools/lut_check.cpp -o lut_check && ./lut_check
+
+#include <stdint.h>
+#include <stdio.h>
+#include <math.h>
+
+typedef uint8_t byte;
+#include "specifications.h"
+#include "sensors.h"
+
+int legacyMotorPosition(float currentPosVolts) {
+    if (currentPosVolts < LOW_LIMIT || currentPosVolts > HIGH_LIMIT) {
+        return -2;
+    } else if (currentPosVolts > LOCK_V - MOTOR_DRIFT_TOLERANCE_V && currentPosVolts < LOCK_V + MOTOR_DRIFT_TOLERANCE_V) {
+        return FOURHI;
+    } else if (currentPosVolts > AWD_V - MOTOR_DRIFT_TOLERANCE_V && currentPosVolts < AWD_V + MOTOR_DRIFT_TOLERANCE_V) {
+        return AWD;
+    } else if (currentPosVolts > N_V - MOTOR_DRIFT_TOLERANCE_V && currentPosVolts < N_V + MOTOR_DRIFT_TOLERANCE_V) {
+        return NEUTRAL;
+    } else if (currentPosVolts > LO_V - MOTOR_DRIFT_TOLERANCE_V && currentPosVolts < LO_V + MOTOR_DRIFT_TOLERANCE_V) {
+        return FOURLO;
+    }
+    return -1;
+}
+
+int legacySwitchPosition(long ohms) {
+    if (ohms < SW_SHORTED_HIGH || ohms > SW_OPEN_LOW) {
+        return -2;
+    } else if (ohms > SW_LOCK_LOW && ohms < SW_LOCK_HIGH) {
+        return FOURHI;
+    } else if (ohms > SW_AWD_LOW && ohms < SW_AWD_HIGH) {
+        return AWD;
+    } else if (ohms > SW_N_LOW && ohms < SW_N_HIGH) {
+        return NEUTRAL;
+    } else if (ohms > SW_LO_LOW && ohms < SW_LO_HIGH) {
+        return FOURLO;
+    }
+    return -1;
+}
+
+// Volts and ohms the way the firmware used to calculate them (AVR float == double, so all float here)
+float legacyVolts(float count) {
+    return ADC_VIN*count/1023.0f;
+}
+
+long legacyOhms(float count, bool &overflow) {
+    float Vout = legacyVolts(count);
+    float ohms = roundf(SWITCH_FIXED_RESISTOR*(ADC_VIN - Vout)/Vout);
+    overflow = !(ohms <= 32767);  // Old code stored this in a 16 bit int (inf when count == 0)
+    return overflow ? 0 : (long)ohms;
+}
+
+int expectedSwitch(float count) {
+    bool overflow;
+    long ohms = legacyOhms(count, overflow);
+    return overflow ? -2 : legacySwitchPosition(ohms);  // Overflow was undefined, it is treated as open now
+}
+
+void printRanges(const char *name, int shift) {
+    printf("%s:\n", name);
+    int start = 0;
+    int code = (pgm_read_byte(&POSITION_LUT[0]) >> shift & 0x0F) - 2;
+    for (int count = 1; count <= LUT_SIZE; count++) {
+        int next = (count < LUT_SIZE) ? (pgm_read_byte(&POSITION_LUT[count]) >> shift & 0x0F) - 2 : 99;
+        if (next != code) {
+            printf("  counts %4d - %4d (%.3f - %.3f V): %d\n", start, count - 1, legacyVolts(start), legacyVolts(count - 1), code);
+            start = count;
+            code = next;
+        }
+    }
+}
+
+int main() {
+    long errors = 0;
+
+    for (int count = 0; count < LUT_SIZE; count++) {
+        int motor = (pgm_read_byte(&POSITION_LUT[count]) >> 4) - 2;
+        int sw = (pgm_read_byte(&POSITION_LUT[count]) & 0x0F) - 2;
+        if (motor != legacyMotorPosition(legacyVolts(count))) {
+            printf("LUT motor mismatch at count %d: table %d, legacy %d\n", count, motor, legacyMotorPosition(legacyVolts(count)));
+            errors++;
+        }
+        if (sw != expectedSwitch(count)) {
+            printf("LUT switch mismatch at count %d: table %d, legacy %d\n", count, sw, expectedSwitch(count));
+            errors++;
+        }
+    }
+
+    for (uint32_t reading = 0; reading <= READING_FULL_SCALE; reading++) {
+        float count = (float)reading/(1 << READING_SHIFT);
+        if (classifyMotorReading(reading) != legacyMotorPosition(legacyVolts(count))) {
+            printf("Motor mismatch at reading %u\n", reading);
+            errors++;
+        }
+        if (classifySwitchReading(reading) != expectedSwitch(count)) {
+            printf("Switch mismatch at reading %u\n", reading);
+            errors++;
+        }
+    }
+
+    printRanges("Mode sensor", 4);
+    printRanges("Selector switch", 0);
+    printf("%ld mismatches (%d table entries, %lu readings)\n", errors, LUT_SIZE, (unsigned long)READING_FULL_SCALE + 1);
+    return errors == 0 ? 0 : 1;
+}
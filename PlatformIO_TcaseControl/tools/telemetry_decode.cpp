@@ -0,0 +1,97 @@
+// Decodes a capture of the firmware's binary telemetry stream (src/telemetry.h) into CSV
+//
+// Frames are COBS encoded packets (layout in src/cobs.h) separated by 0 bytes. Anything that doesn't decode, has a
+// bad checksum or an unknown type (e.g. text from the other Serial commands) is skipped and counted.
+//
+// Build from PlatformIO_TcaseControl:
+//   g++ -std=c++11 -I src tools/telemetry_decode.cpp -o telemetry_decode
+// Capture (send 't' to start the stream) and decode:
+//   stty -F /dev/ttyUSB0 115200 raw && cat /dev/ttyUSB0 > trace.bin
+//   ./telemetry_decode trace.bin > trace.csv
+// The stored shift history and counters (send 'h', see src/history.h) go to a second CSV if one is given:
+//   ./telemetry_decode -H history.csv dump.bin > /dev/null
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include "cobs.h"
+
+const double ADC_VOLTS_PER_COUNT = 5.0 / 1023;
+const double READING_VOLTS = ADC_VOLTS_PER_COUNT / 64;  // reading_t is a count << 6 (src/sensors.h)
+
+int main(int argc, char **argv) {
+    FILE *in = stdin;
+    FILE *history = nullptr;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-H") && i + 1 < argc) {
+            history = fopen(argv[++i], "w");
+            if (!history) {
+                perror(argv[i]);
+                return 1;
+            }
+        } else {
+            in = fopen(argv[i], "rb");
+            if (!in) {
+                perror(argv[i]);
+                return 1;
+            }
+        }
+    }
+
+    printf("type,time_us,mode_count,mode_v,switch_count,pwm,direction,brake,phase,event,from,to,flags\n");
+    if (history) {
+        fprintf(history, "type,sequence,from,to,duration_ms,retries,stalls,flags,final_v,shifts,failed,recovered\n");
+    }
+    std::vector<uint8_t> frame;
+    uint8_t decoded[256];
+    long samples = 0, events = 0, stored = 0, bad = 0;
+    int c;
+    while ((c = fgetc(in)) != EOF) {
+        if (c != 0) {
+            if (frame.size() < sizeof(decoded)) {
+                frame.push_back(c);
+            }
+            continue;
+        }
+        size_t length = frame.empty() ? 0 : cobsDecode(frame.data(), frame.size(), decoded);
+        frame.clear();
+        if (length < 2 || telemetryChecksum(decoded, length - 1) != decoded[length - 1]) {
+            bad++;
+            continue;
+        }
+        length--;
+        if (decoded[0] == TELEMETRY_SAMPLE && length == sizeof(TelemetrySample)) {
+            TelemetrySample s;
+            memcpy(&s, decoded, sizeof(s));
+            printf("sample,%u,%u,%.3f,%u,%u,%d,%u,%u,,,,\n", s.timeUs, s.modeCount, s.modeCount * ADC_VOLTS_PER_COUNT,
+                s.switchCount, s.pwm, s.direction, s.brake, s.phase);
+            samples++;
+        } else if (decoded[0] == TELEMETRY_EVENT && length == sizeof(TelemetryEvent)) {
+            TelemetryEvent e;
+            memcpy(&e, decoded, sizeof(e));
+            printf("event,%u,,,,,,,,%u,%d,%d,%u\n", e.timeUs, e.event, e.from, e.to, e.flags);
+            events++;
+        } else if (decoded[0] == TELEMETRY_HISTORY && length == sizeof(TelemetryHistory)) {
+            TelemetryHistory h;
+            memcpy(&h, decoded, sizeof(h));
+            if (history) {
+                fprintf(history, "shift,%u,%d,%d,%u,%u,%u,%u,%.3f,,,\n", h.record.sequence, h.record.from, h.record.to,
+                    h.record.durationMs, h.record.retries, h.record.stalls, h.record.flags, h.record.finalReading * READING_VOLTS);
+            }
+            stored++;
+        } else if (decoded[0] == TELEMETRY_COUNTERS && length == sizeof(TelemetryCounters)) {
+            TelemetryCounters c;
+            memcpy(&c, decoded, sizeof(c));
+            if (history) {
+                fprintf(history, "pair,,%d,%d,,%u,,,,%u,%u,%u\n", c.from, c.to, c.counters.retries, c.counters.shifts,
+                    c.counters.failed, c.counters.recovered);
+            }
+            stored++;
+        } else {
+            bad++;
+        }
+    }
+    fprintf(stderr, "%ld samples, %ld events, %ld history/counter records, %ld bad frames\n", samples, events, stored, bad);
+    return 0;
+}